@@ -62,6 +62,7 @@
 #define DEBUG(fmt, ...) {if (verbose) { printf (fmt, ## __VA_ARGS__);}}
 #define UDP_PORT        18246
 int verbose = 0;
+int sequence = 0;               /* Stamp sequence number in payload */
 
 /* Program meta data */
 char *progname;                 /* argv[0] */
@@ -243,6 +244,10 @@ static int send_to_addresses (int sd, in_addr_t address, int num, const char *da
  *
  * ... add neat documentation of functionality here ...
  *
+ * With --sequence the first four bytes of every payload carry a burst
+ * counter, in network byte order.  All groups in a burst get the same
+ * number, so a receiver like mdump -f can count lost packets per group.
+ *
  * Returns:
  * Zero (0) on success, non-zero otherwise.
  */
@@ -250,6 +255,8 @@ static int send_loop (char *iface, uint32_t address, int num, int count,
                       uint8_t ttl, uint8_t qos, int rate, const char *data, size_t len)
 {
    int sd, delay;
+   uint32_t seq = 0;
+   char buf[len];
 
    int loop (void)
    {
@@ -274,10 +281,18 @@ static int send_loop (char *iface, uint32_t address, int num, int count,
    }
 
    delay = throttle_calibrate (rate);
+   memcpy (buf, data, len);
 
    while (loop ())
    {
-      if (send_to_addresses (sd, address, num, data, len))
+      if (sequence)
+      {
+         uint32_t net = htonl (seq++);
+
+         memcpy (buf, &net, sizeof (net));
+      }
+
+      if (send_to_addresses (sd, address, num, buf, len))
       {
          return 1;
       }
@@ -303,6 +318,7 @@ int usage (char *name)
            " -c, --count=num            Number of packets to send, in total.\n"
            " -p, --payload=0XAA         Payload, repeated --size times.\n"
            " -Q, --tos=tos              Set Quality of Service-related bits.\n"
+           " -S, --sequence             Stamp a sequence number first in each payload.\n"
            " -r, --rate=rate            Packets per second.\n"
            " -s, --size=len             Payload size, in bytes.\n"
            " -t, --ttl=ttl              Set IP Time to Live.\n"
@@ -343,11 +359,12 @@ int main (int argc, char *argv[])
       {"size", 1, 0, 's'},
       {"ttl", 1, 0, 't'},
       {"payload", 1, 0, 'p'},
+      {"sequence", 0, 0, 'S'},
       {"help", 0, 0, '?'},
       {0, 0, 0, 0}
     };
 
-   while ((c = getopt_long (argc, argv, "i:c:p:Q:r:s:t:vVh?", long_options, NULL)) != EOF)
+   while ((c = getopt_long (argc, argv, "i:c:n:p:Q:r:s:St:vVh?", long_options, NULL)) != EOF)
    {
       switch (c)
       {
@@ -361,6 +378,13 @@ int main (int argc, char *argv[])
             DEBUG("Count: %u\n", num);
             break;
 
+         case 'n':              /* --number-groups */
+            num = strtoul (optarg, NULL, 0);
+            DEBUG("Groups: %d\n", num);
+            /* Sanity check... */
+            num = num < 1 ? 1 : num;
+            break;
+
          case 'Q':              /* --tos */
             qos = strtoul (optarg, NULL, 0);
             DEBUG("QoS: %d\n", qos);
@@ -380,6 +404,10 @@ int main (int argc, char *argv[])
             len = len > 64 ? len - 42 : 22; /* At least 64 bytes */
             break;
 
+         case 'S':              /* --sequence */
+            sequence = 1;
+            break;
+
          case 't':              /* --ttl */
             ttl = strtoul (optarg, NULL, 0);
             DEBUG("Size: %u bytes payload\n", ttl);
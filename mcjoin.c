@@ -6,120 +6,2494 @@
  * Build on any Linux/BSD with "make mcjoin"
  */
 
+#define _GNU_SOURCE             /* setsourcefilter() */
+
 #include <arpa/inet.h>
+#include <math.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <libgen.h>
+#include <net/ethernet.h>
 #include <net/if.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <netinet/in.h>
+#include <linux/if_packet.h>
 //#include <otn/c.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-#define DEBUG(fmt, ...) {if (verbose) { printf (fmt, ## __VA_ARGS__);}}
+#define DEBUG(fmt, ...) {if (verbose) { printf (fmt, ## __VA_ARGS__);}}
+
+#define DEFAULT_GROUP "14.1.2.3"
+#define DEFAULT_LIMIT IP_MAX_MEMBERSHIPS
+
+#define WHEEL_SLOTS   8192             /* Must be a power of two */
+#define WHEEL_TICK    100000           /* nsec, 100 usec */
+#define LATMAX        10000            /* usec, latency histogram range */
+#define DEFAULT_PORT  12345            /* Same as mcgen */
+#define MAXEVENTS     64
+#define MONITOR       -1               /* epoll tag of the packet socket */
+#define LEAVE_MAX     4                /* Measure: leave phase cap, in timeouts */
+#define DEFAULT_MSF   10               /* Sources per filter, igmp_max_msf */
+#define DEFAULT_MLD_MSF 64             /* Sources per filter, mld_max_msf */
+#define MLD_SOCKLIST  64               /* Approx. optmem cost of an IPv6 membership */
+
+/* Program meta data */
+const char *doc = "Multicast Join Group Test Program";
+const char *program_version = "$Date: 2007-01-30 23:33:08 +0100 (Tue, 30 Jan 2007) $ $Rev: 4070 $";
+const char *program_bug_address = "Joachim Nilsson <troglobit at gmail.com>";
+
+/* Mode flags */
+int quiet = 0;
+int verbose = 0;
+volatile sig_atomic_t running = 1;
+
+/* getopt externals */
+extern int optind;
+
+/*
+ * Timer wheel, timers are hashed on their expiry tick into one of
+ * WHEEL_SLOTS lists.  Timers further away than one lap stay in their
+ * list until the wheel comes around again.  Timers are embedded in the
+ * objects they belong to, so arming one never allocates.
+ */
+struct timer
+{
+   struct timer *next;
+   uint64_t expires;            /* nsec, CLOCK_MONOTONIC */
+   void (*cb) (struct timer *);
+   int armed;
+};
+
+struct wheel
+{
+   struct timer *slot[WHEEL_SLOTS];
+   uint64_t tick;               /* Next tick to run */
+};
+
+/* A requested group, parsed once up front */
+struct group
+{
+   struct sockaddr_storage addr;
+   int slot;                    /* Pool socket holding membership, -1 if none */
+   struct timer timer;          /* Churn: scheduled leave */
+
+   uint64_t joined, first;      /* Measure: nsec, CLOCK_REALTIME */
+   uint64_t left, last;
+
+   struct sockaddr_storage *src; /* SSM: INCLUDE sources, NULL for any-source */
+   int nsrc;
+   int round;                   /* SSM: which slice of the source list */
+};
+
+/* Sorted index for looking up received packets, IPv4 is v4-mapped */
+struct gkey
+{
+   unsigned char addr[16];
+   int idx;
+};
+
+/* Latency histogram, one bucket per usec, last is overflow */
+struct histogram
+{
+   unsigned long bucket[LATMAX + 1];
+   unsigned long count;
+   uint64_t max;
+};
+
+/*
+ * Membership manager.  The kernel caps the number of groups a single
+ * socket may join, net.ipv4.igmp_max_memberships, so joins are spread
+ * over a pool of sockets.  Sockets with room left are kept on a stack,
+ * when a leave frees up a slot on a full socket it is pushed back.
+ */
+struct pool
+{
+   int family;
+   int ifindex;
+   int limit;                   /* Memberships per socket */
+
+   int *sd;                     /* Socket descriptors */
+   int *count;                  /* Memberships on each socket */
+   char *full;                  /* Socket is at its limit */
+   int num;                     /* Open sockets */
+   int size;                    /* Allocated entries */
+
+   int *room;                   /* Stack of sockets with room left */
+   int nroom;
+
+   unsigned long limits;        /* Joins refused with ENOBUFS */
+
+   int port;                    /* Bind sockets to receive, 0 to not */
+   int epfd;                    /* Sockets are added here when bound */
+
+   int msf;                     /* Sources per filter, igmp_max_msf */
+   int incremental;             /* Add sources one call at a time */
+   int round;                   /* Source slice the room stack is used for */
+   unsigned long calls;         /* Source filter setsockopt() calls */
+   unsigned long sources;       /* Sources installed */
+
+   unsigned long progress;      /* Groups joined, read by other threads */
+};
+
+/* SSM source list, from all --source options */
+struct sockaddr_storage *sources;
+int nsources;
+int source_family;
+
+static int usage (char *name)
+{
+   fprintf (stderr,
+            "%s\n"
+            "-------------------------------------------------------------------------------\n"
+            "Usage: %s  [OPTIONS] [-i iface] [-f FIRST-MC-GROUP] [-n TOTAL-GROUPS] [GROUP0 .. GROUPN]\n"
+            "Mandatory arguments to long options are mandatory for short options too.\n"
+            "\n"
+            "Options:\n"
+            " -f, --first-group=1.2.3.3          First Mulitcast group, e.g. 225.0.0.1 or ff3e::8000:1\n"
+            " -n, --groups=N                     Total number of Mulitcast groups, e.g. 50\n"
+            " -i, --interface=IFACE[=GROUP[/N]]  Interface to subscribe groups on, may be repeated to\n"
+            "                                    join in parallel.  Own set of N groups from GROUP.\n"
+            " -c, --churn=steady|burst|random    Repeatedly join and leave the groups.\n"
+            " -r, --rate=N                       Churn: joins, emulate: reports, per second, default 100\n"
+            " -l, --leave-rate=N                 Churn: leaves per second, default same as joins\n"
+            " -b, --burst=N                      Churn: groups per burst, default 10\n"
+            " -H, --hold=SEC                     Churn: time a group stays joined, default 1.0\n"
+            " -d, --duration=SEC                 Churn, emulate: stop after SEC seconds, default forever\n"
+            " -s, --source=ADDR[-ADDR][,...]     SSM: join (S,G), sources or ranges, may be repeated\n"
+            " -I, --incremental                  SSM: add one source per call, not a full-state filter\n"
+            " -e, --emulate=N                    Send raw IGMP reports for N emulated hosts, answer queries\n"
+            " -a, --address=ADDR                 Emulate: address of first host, default 10.0.0.1\n"
+            " -g, --igmp=2|3                     Emulate: IGMP version, default 3\n"
+            " -m, --measure                      Measure join to first, and leave to last, packet\n"
+            " -p, --port=PORT                    Measure: UDP port to receive on, default %d\n"
+            " -t, --timeout=SEC                  Measure: give up waiting after SEC, default 5.0\n"
+            " -A, --audit                        Verify memberships in /proc/net/igmp{,6} after joining\n"
+            " -q, --quiet                        Quiet mode.\n"
+            " -v, --version                      Display program version.\n"
+            " -?, --help                         This help text.\n"
+            "-------------------------------------------------------------------------------\n"
+            "Copyright (C) 2004  %s\n"
+            "\n",
+            doc, basename (name), DEFAULT_PORT, program_bug_address);
+
+   return 1;
+}
+
+static double timespec_diff (struct timespec *start, struct timespec *stop)
+{
+   return (stop->tv_sec - start->tv_sec) + (stop->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int read_sysctl (const char *path, int fallback)
+{
+   FILE *fp;
+   int val;
+
+   fp = fopen (path, "r");
+   if (!fp)
+      return fallback;
+   if (fscanf (fp, "%d", &val) != 1 || val <= 0)
+      val = fallback;
+   fclose (fp);
+
+   return val;
+}
+
+/*
+ * One socket per igmp_max_memberships groups, make sure we may open
+ * them.  Every pool adds to what is reserved, they all share one limit.
+ */
+static void raise_fd_limit (int num)
+{
+   static rlim_t reserved = 16;
+   struct rlimit rl;
+
+   reserved += num;
+   if (getrlimit (RLIMIT_NOFILE, &rl))
+      return;
+   if (rl.rlim_cur >= reserved)
+      return;
+
+   rl.rlim_cur = reserved;
+   if (rl.rlim_cur > rl.rlim_max)
+      rl.rlim_cur = rl.rlim_max;
+   if (setrlimit (RLIMIT_NOFILE, &rl))
+      fprintf (stderr, "%s: Failed raising open files limit: %s\n", __FUNCTION__, strerror (errno));
+}
+
+static int pool_init (struct pool *pool, int family, char *iface, int groups)
+{
+   memset (pool, 0, sizeof (*pool));
+   pool->family = family;
+
+   pool->ifindex = if_nametoindex (iface);
+   if (!pool->ifindex)
+   {
+      fprintf (stderr, "%s: \"%s\" invalid interface\n", __FUNCTION__, iface);
+      return 1;
+   }
+   DEBUG("Using iface %s, idx %d\n", iface, pool->ifindex);
+
+   if (family == AF_INET)
+   {
+      pool->limit = read_sysctl ("/proc/sys/net/ipv4/igmp_max_memberships", DEFAULT_LIMIT);
+      pool->msf = read_sysctl ("/proc/sys/net/ipv4/igmp_max_msf", DEFAULT_MSF);
+      raise_fd_limit (groups / pool->limit + 1);
+   }
+   else
+   {
+      /*
+       * No MLD counterpart to igmp_max_memberships, IPv6 memberships
+       * are charged to the socket's optmem_max instead.  Let the kernel
+       * tell us when a socket is full, size the fd limit on a guess.
+       */
+      pool->limit = INT_MAX;
+      pool->msf = read_sysctl ("/proc/sys/net/ipv6/mld_max_msf", DEFAULT_MLD_MSF);
+      raise_fd_limit (groups / (read_sysctl ("/proc/sys/net/core/optmem_max", 20480) / MLD_SOCKLIST) + 1);
+   }
+
+   return 0;
+}
+
+static void pool_exit (struct pool *pool)
+{
+   int i;
+
+   for (i = 0; i < pool->num; i++)
+      close (pool->sd[i]);
+
+   free (pool->sd);
+   free (pool->count);
+   free (pool->full);
+   free (pool->room);
+}
+
+/*
+ * All pool sockets share INADDR_ANY:port.  With IP_MULTICAST_ALL off
+ * each one only receives its own groups, and IP_PKTINFO tells which.
+ */
+static int pool_bind (struct pool *pool, int sd)
+{
+   struct sockaddr_in sin;
+   struct epoll_event ev;
+   int on = 1, off = 0;
+
+   setsockopt (sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+   setsockopt (sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on));
+   setsockopt (sd, IPPROTO_IP, IP_PKTINFO, &on, sizeof (on));
+#ifdef IP_MULTICAST_ALL
+   setsockopt (sd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof (off));
+#endif
+   fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) | O_NONBLOCK);
+
+   memset (&sin, 0, sizeof (sin));
+   sin.sin_family = AF_INET;
+   sin.sin_port = htons (pool->port);
+   if (bind (sd, (struct sockaddr *)&sin, sizeof (sin)))
+   {
+      fprintf (stderr, "%s: Failed binding to port %d: %s\n", __FUNCTION__, pool->port, strerror (errno));
+      return 1;
+   }
+
+   ev.events = EPOLLIN;
+   ev.data.fd = sd;
+   if (epoll_ctl (pool->epfd, EPOLL_CTL_ADD, sd, &ev))
+   {
+      fprintf (stderr, "%s: Failed adding socket to epoll: %s\n", __FUNCTION__, strerror (errno));
+      return 1;
+   }
+
+   return 0;
+}
+
+/* Open another socket, returns its slot or -1 on error */
+static int pool_grow (struct pool *pool)
+{
+   int sd, slot;
+
+   if (pool->num == pool->size)
+   {
+      int size = pool->size ? pool->size * 2 : 64;
+
+      pool->sd    = realloc (pool->sd, size * sizeof (int));
+      pool->count = realloc (pool->count, size * sizeof (int));
+      pool->full  = realloc (pool->full, size);
+      pool->room  = realloc (pool->room, size * sizeof (int));
+      if (!pool->sd || !pool->count || !pool->full || !pool->room)
+      {
+         fprintf (stderr, "%s: Out of memory\n", __FUNCTION__);
+         return -1;
+      }
+      pool->size = size;
+   }
+
+   sd = socket (pool->family, SOCK_DGRAM, 0);
+   if (sd < 0)
+   {
+      fprintf (stderr, "%s: Failed opening socket(): %s\n", __FUNCTION__, strerror (errno));
+      return -1;
+   }
+
+   if (pool->port && pool_bind (pool, sd))
+   {
+      close (sd);
+      return -1;
+   }
+
+   slot = pool->num++;
+   pool->sd[slot] = sd;
+   pool->count[slot] = 0;
+   pool->full[slot] = 0;
+   pool->room[pool->nroom++] = slot;
+
+   return slot;
+}
+
+static void pool_set_full (struct pool *pool, int slot)
+{
+   pool->full[slot] = 1;
+   pool->nroom--;               /* Always the top of the stack */
+}
+
+/*
+ * A socket can only hold igmp_max_msf sources per group, so longer
+ * source lists are sliced over several sockets, each one holding the
+ * group once.  Starting a new slice retires all sockets that still
+ * have room, they may already hold the same group.
+ */
+static void pool_seal (struct pool *pool, int round)
+{
+   while (pool->nroom)
+      pool_set_full (pool, pool->room[pool->nroom - 1]);
+   pool->round = round;
+}
+
+/*
+ * Install the source list of @g on a socket already joined to its first
+ * source.  On error errno is left for the caller, who decides if it is
+ * only the socket that is out of option memory.
+ */
+static const char *pool_sources (struct pool *pool, int slot, struct group *g)
+{
+   struct group_source_req req;
+   int i, level;
+
+   if (!pool->incremental)
+   {
+      pool->calls++;
+      if (setsourcefilter (pool->sd[slot], pool->ifindex, (struct sockaddr *)&g->addr,
+                           pool->family == AF_INET ? sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6),
+                           MCAST_INCLUDE, g->nsrc, g->src))
+         return "setsourcefilter()";
+
+      return NULL;
+   }
+
+   level = pool->family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+   memset (&req, 0, sizeof (req));
+   req.gsr_interface = pool->ifindex;
+   req.gsr_group = g->addr;
+   for (i = 1; i < g->nsrc; i++)
+   {
+      req.gsr_source = g->src[i];
+      pool->calls++;
+      if (setsockopt (pool->sd[slot], level, MCAST_JOIN_SOURCE_GROUP, &req, sizeof (req)))
+         return "MCAST_JOIN_SOURCE_GROUP";
+   }
+
+   return NULL;
+}
+
+static int pool_leave (struct pool *pool, struct group *g)
+{
+   struct group_req req;
+   int slot = g->slot, level;
+
+   if (slot < 0)
+      return 0;
+
+   level = pool->family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+   memset (&req, 0, sizeof (req));
+   req.gr_interface = pool->ifindex;
+   req.gr_group = g->addr;
+   if (setsockopt (pool->sd[slot], level, MCAST_LEAVE_GROUP, &req, sizeof (req)))
+   {
+      fprintf (stderr, "%s: MCAST_LEAVE_GROUP: %s\n", __FUNCTION__, strerror (errno));
+      return 1;
+   }
+
+   g->slot = -1;
+   pool->count[slot]--;
+   if (pool->full[slot])
+   {
+      pool->full[slot] = 0;
+      pool->room[pool->nroom++] = slot;
+   }
+
+   return 0;
+}
+
+static int pool_join (struct pool *pool, struct group *g)
+{
+   struct group_source_req sreq;
+   struct group_req req;
+   int slot, level, opt, len;
+   const char *fail;
+   void *arg;
+
+   level = pool->family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+   if (g->src)
+   {
+      /* (S,G) with the first source, the rest is added on the same socket */
+      memset (&sreq, 0, sizeof (sreq));
+      sreq.gsr_interface = pool->ifindex;
+      sreq.gsr_group = g->addr;
+      sreq.gsr_source = g->src[0];
+      opt = MCAST_JOIN_SOURCE_GROUP;
+      arg = &sreq;
+      len = sizeof (sreq);
+
+      if (g->round != pool->round)
+         pool_seal (pool, g->round);
+   }
+   else
+   {
+      memset (&req, 0, sizeof (req));
+      req.gr_interface = pool->ifindex;
+      req.gr_group = g->addr;
+      opt = MCAST_JOIN_GROUP;
+      arg = &req;
+      len = sizeof (req);
+   }
+
+   while (1)
+   {
+      if (pool->nroom)
+         slot = pool->room[pool->nroom - 1];
+      else
+         slot = pool_grow (pool);
+      if (slot < 0)
+         return 1;
+
+      fail = NULL;
+      if (setsockopt (pool->sd[slot], level, opt, arg, len))
+         fail = g->src ? "MCAST_JOIN_SOURCE_GROUP" : "MCAST_JOIN_GROUP";
+      else if (g->src)
+      {
+         pool->calls++;
+         if (g->nsrc > 1)
+         {
+            fail = pool_sources (pool, slot, g);
+            if (fail)
+            {
+               int err = errno;
+
+               g->slot = slot;
+               pool->count[slot]++;
+               pool_leave (pool, g);
+               errno = err;
+            }
+         }
+      }
+      if (!fail)
+         break;
+
+      /*
+       * The kernel knows the real per-socket limit, memberships for IPv4
+       * and option memory for IPv6 and source lists, move on to a new socket
+       */
+      if ((errno == ENOBUFS || errno == ENOMEM) && pool->count[slot] > 0)
+      {
+         pool->limits++;
+         pool_set_full (pool, slot);
+         continue;
+      }
+
+      fprintf (stderr, "%s: %s: %s\n", __FUNCTION__, fail, strerror (errno));
+      return 1;
+   }
+
+   g->slot = slot;
+   pool->sources += g->nsrc;
+   if (++pool->count[slot] >= pool->limit)
+      pool_set_full (pool, slot);
+
+   return 0;
+}
+
+static char *group_str (struct group *g)
+{
+   static char buf[INET6_ADDRSTRLEN];
+   sa_family_t family;
+   void *addr;
+
+   memcpy (&family, &g->addr.ss_family, sizeof (family));
+   if (family == AF_INET)
+      addr = &((struct sockaddr_in *)&g->addr)->sin_addr;
+   else
+      addr = &((struct sockaddr_in6 *)&g->addr)->sin6_addr;
+
+   return (char *)inet_ntop (family, addr, buf, sizeof (buf));
+}
+
+/* Parse an IPv4 or IPv6 address, returns its family or 0 */
+static int addr_parse (const char *str, struct sockaddr_storage *ss)
+{
+   struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+   struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+   memset (ss, 0, sizeof (*ss));
+   if (inet_pton (AF_INET, str, &sin->sin_addr) == 1)
+      return sin->sin_family = AF_INET;
+   if (inet_pton (AF_INET6, str, &sin6->sin6_addr) == 1)
+      return sin6->sin6_family = AF_INET6;
+
+   return 0;
+}
+
+/* Low 32 bits of an address, all of it for IPv4, host byte order */
+static uint32_t addr_low (const struct sockaddr_storage *ss, int family)
+{
+   uint32_t low;
+
+   if (family == AF_INET)
+      memcpy (&low, &((struct sockaddr_in *)ss)->sin_addr, 4);
+   else
+      memcpy (&low, &((struct sockaddr_in6 *)ss)->sin6_addr.s6_addr[12], 4);
+
+   return ntohl (low);
+}
+
+/* Address @offset steps from @base, ranges only ever span the low 32 bits */
+static void addr_set (struct sockaddr_storage *ss, const struct sockaddr_storage *base, int family, uint32_t offset)
+{
+   uint32_t low = htonl (addr_low (base, family) + offset);
+
+   memcpy (ss, base, sizeof (*ss));
+   if (family == AF_INET)
+      memcpy (&((struct sockaddr_in *)ss)->sin_addr, &low, 4);
+   else
+      memcpy (&((struct sockaddr_in6 *)ss)->sin6_addr.s6_addr[12], &low, 4);
+}
+
+static void group_set (struct group *g, const struct sockaddr_storage *base, int family, uint32_t offset)
+{
+   memset (g, 0, sizeof (*g));
+   addr_set (&g->addr, base, family, offset);
+   g->slot = -1;
+}
+
+static int join_groups (struct pool *pool, char *iface, struct group *groups, int num)
+{
+   struct timespec start, stop;
+   double elapsed;
+   int i;
+
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   for (i = 0; i < num; i++)
+   {
+      DEBUG("Trying to join %s\n", group_str (&groups[i]));
+      if (pool_join (pool, &groups[i]))
+      {
+         /* Bailing out. */
+         DEBUG("Bailing out...\n");
+         return 1;
+      }
+      __atomic_store_n (&pool->progress, i + 1, __ATOMIC_RELAXED);
+
+      if (!quiet)
+      {
+         if (groups[i].src)
+            printf ("joined group %s, %d sources, on %s ...\n", group_str (&groups[i]), groups[i].nsrc, iface);
+         else
+            printf ("joined group %s on %s ...\n", group_str (&groups[i]), iface);
+         fflush (stdout);
+      }
+   }
+   clock_gettime (CLOCK_MONOTONIC, &stop);
+
+   elapsed = timespec_diff (&start, &stop);
+   printf ("Joined %d groups on %s in %.3f sec, %.0f joins/sec, %d sockets",
+           num, iface, elapsed, elapsed > 0 ? num / elapsed : 0.0, pool->num);
+   if (pool->limit != INT_MAX)
+      printf (" of max %d groups", pool->limit);
+   if (pool->limits)
+      printf (", kernel per-socket limit hit %lu times", pool->limits);
+   printf ("\n");
+   if (pool->sources)
+      printf ("Installed %lu sources with %lu %s calls, %.0f sources/sec\n", pool->sources, pool->calls,
+              pool->incremental ? "MCAST_JOIN_SOURCE_GROUP" : "MCAST_JOIN_SOURCE_GROUP/setsourcefilter()",
+              elapsed > 0 ? pool->sources / elapsed : 0.0);
+   fflush (stdout);
+
+   return 0;
+}
+
+static void leave_groups (struct pool *pool, char *iface, struct group *groups, int num)
+{
+   struct timespec start, stop;
+   double elapsed;
+   int i, left = 0;
+
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   for (i = 0; i < num; i++)
+   {
+      if (groups[i].slot < 0)
+         continue;
+      if (!pool_leave (pool, &groups[i]))
+         left++;
+   }
+   clock_gettime (CLOCK_MONOTONIC, &stop);
+
+   if (!left)
+      return;
+
+   elapsed = timespec_diff (&start, &stop);
+   printf ("Left %d groups on %s in %.3f sec, %.0f leaves/sec\n",
+           left, iface, elapsed, elapsed > 0 ? left / elapsed : 0.0);
+}
+
+/* Append "ADDR", "ADDR-ADDR" or a comma separated list of them, IPv4 or IPv6 */
+static int source_parse (char *arg)
+{
+   char *tok, *end;
+
+   for (tok = strtok (arg, ","); tok; tok = strtok (NULL, ","))
+   {
+      struct sockaddr_storage first, last;
+      uint32_t i, count;
+      int family;
+
+      end = strchr (tok, '-');
+      if (end)
+         *end++ = 0;
+      family = addr_parse (tok, &first);
+      if (!family || (end && addr_parse (end, &last) != family))
+      {
+         fprintf (stderr, "Source %s is not a valid address or range\n", tok);
+         return 1;
+      }
+      if (!end)
+         last = first;
+      if (family == AF_INET6 &&
+          memcmp (&((struct sockaddr_in6 *)&first)->sin6_addr, &((struct sockaddr_in6 *)&last)->sin6_addr, 12))
+      {
+         fprintf (stderr, "Source range %s-%s may only span the low 32 bits\n", tok, end);
+         return 1;
+      }
+      if (addr_low (&last, family) < addr_low (&first, family))
+      {
+         fprintf (stderr, "Source range %s-%s is backwards\n", tok, end);
+         return 1;
+      }
+      if (nsources && source_family != family)
+      {
+         fprintf (stderr, "Cannot mix IPv4 and IPv6 sources\n");
+         return 1;
+      }
+
+      source_family = family;
+      count = addr_low (&last, family) - addr_low (&first, family);
+      for (i = 0; i <= count; i++)
+      {
+         if ((nsources & 1023) == 0)
+         {
+            sources = realloc (sources, (nsources + 1024) * sizeof (struct sockaddr_storage));
+            if (!sources)
+            {
+               perror ("Failed allocating source list");
+               return 1;
+            }
+         }
+
+         addr_set (&sources[nsources++], &first, family, i);
+         if (i == UINT32_MAX)
+            break;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Slice the source list over the groups, igmp_max_msf sources at a
+ * time.  The table is laid out slice by slice, so a slice is joined
+ * for all groups before the pool moves on to fresh sockets for the
+ * next one.  Returns the new number of entries, or -1 on error.
+ */
+static int source_expand (struct group **groups, int num, int msf)
+{
+   struct group *table;
+   int rounds, r, i;
+
+   rounds = (nsources + msf - 1) / msf;
+   table = calloc ((size_t)num * rounds, sizeof (struct group));
+   if (!table)
+   {
+      perror ("Failed allocating group table");
+      return -1;
+   }
+
+   for (r = 0; r < rounds; r++)
+   {
+      for (i = 0; i < num; i++)
+      {
+         struct group *g = &table[r * num + i];
+
+         *g = (*groups)[i];
+         g->src = &sources[r * msf];
+         g->nsrc = nsources - r * msf < msf ? nsources - r * msf : msf;
+         g->round = r;
+      }
+   }
+
+   free (*groups);
+   *groups = table;
+
+   return num * rounds;
+}
+
+static void sigcb (int signo __attribute__ ((unused)))
+{
+   running = 0;
+}
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wheel_init (struct wheel *w)
+{
+   memset (w, 0, sizeof (*w));
+   w->tick = now_ns () / WHEEL_TICK;
+}
+
+static void timer_add (struct wheel *w, struct timer *t, uint64_t expires)
+{
+   uint64_t tick = expires / WHEEL_TICK;
+
+   /* Never schedule into the past, the wheel has already gone by */
+   if (tick < w->tick)
+      tick = w->tick;
+
+   t->expires = expires;
+   t->armed = 1;
+   t->next = w->slot[tick & (WHEEL_SLOTS - 1)];
+   w->slot[tick & (WHEEL_SLOTS - 1)] = t;
+}
+
+/* Run all timers up to and including @now, in tick order */
+static void wheel_run (struct wheel *w, uint64_t now)
+{
+   while (w->tick <= now / WHEEL_TICK)
+   {
+      struct timer **pp = &w->slot[w->tick & (WHEEL_SLOTS - 1)], *t;
+      uint64_t end = (w->tick + 1) * WHEEL_TICK;
+
+      while ((t = *pp))
+      {
+         if (t->expires >= end)
+         {
+            pp = &t->next;       /* Next lap */
+            continue;
+         }
+
+         *pp = t->next;
+         t->armed = 0;
+         t->cb (t);
+      }
+      w->tick++;
+   }
+}
+
+/* Sleep until the next tick boundary */
+static void wheel_sleep (struct wheel *w)
+{
+   uint64_t next = w->tick * WHEEL_TICK;
+   struct timespec ts = { next / 1000000000ULL, next % 1000000000ULL };
+
+   clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void hist_add (struct histogram *h, uint64_t nsec)
+{
+   uint64_t usec = nsec / 1000;
+
+   h->bucket[usec < LATMAX ? usec : LATMAX]++;
+   h->count++;
+   if (usec > h->max)
+      h->max = usec;
+}
+
+static void hist_print (const char *name, struct histogram *h)
+{
+   const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+   unsigned long sum = 0;
+   size_t i, j;
+
+   printf ("%-12s %9lu samples", name, h->count);
+   if (!h->count)
+   {
+      printf ("\n");
+      return;
+   }
+
+   for (i = 0, j = 0; j < sizeof (pct) / sizeof (pct[0]); j++)
+   {
+      while (i < LATMAX && (sum + h->bucket[i]) * 100.0 < pct[j] * h->count)
+         sum += h->bucket[i++];
+      printf (", p%g %s%zu", pct[j], i == LATMAX ? ">" : "", i);
+   }
+   printf (", max %llu usec\n", (unsigned long long)h->max);
+}
+
+/*
+ * Churn generator.  Join and leave events are each produced by a
+ * stream of exact points in time, at --rate and --leave-rate, either
+ * evenly spaced (steady), in groups of --burst (burst), or as a Poisson
+ * process (random).  A join takes the next idle group, in order, or a
+ * random one in random mode.  At the same time the group is assigned
+ * the next point in the leave stream, plus --hold, and its own timer
+ * is armed for that.  The timer wheel keeps this exact, and O(1) per
+ * event, however many groups are churning.
+ */
+enum { CHURN_NONE, CHURN_STEADY, CHURN_BURST, CHURN_RANDOM };
+
+struct stream
+{
+   double rate;                 /* Events per second */
+   int burst;
+   unsigned long n;             /* Events so far */
+   uint64_t next;               /* nsec */
+};
+
+struct churn
+{
+   int pattern;
+   struct pool *pool;
+   struct group *groups;
+   int num;
+
+   int *idle;                   /* Ring of groups not joined */
+   int head, nidle;
+
+   struct wheel wheel;
+   struct timer timer;          /* Join stream */
+   struct stream join, leave;
+   uint64_t hold;               /* nsec */
+
+   unsigned long joins, leaves, missed, errors;
+   struct histogram join_lat, leave_lat;
+} churn;
+
+static uint64_t stream_next (struct stream *st, int pattern)
+{
+   uint64_t at = st->next;
+   double gap;
+
+   st->n++;
+   switch (pattern)
+   {
+      case CHURN_BURST:
+         gap = st->n % st->burst ? 0.0 : st->burst / st->rate;
+         break;
+
+      case CHURN_RANDOM:
+         gap = -log (1.0 - drand48 ()) / st->rate;
+         break;
+
+      default:
+         gap = 1.0 / st->rate;
+         break;
+   }
+   st->next += (uint64_t)(gap * 1e9);
+
+   return at;
+}
+
+static void churn_leave (struct timer *t)
+{
+   struct group *g = (struct group *)((char *)t - offsetof (struct group, timer));
+   uint64_t start = now_ns (), retry;
+
+   /* Still a member, try again at the next leave point */
+   if (pool_leave (churn.pool, g))
+   {
+      churn.errors++;
+      retry = stream_next (&churn.leave, churn.pattern);
+      if (retry < start + WHEEL_TICK)
+         retry = start + WHEEL_TICK;     /* Not this tick, it's being run */
+      timer_add (&churn.wheel, &g->timer, retry);
+      return;
+   }
+   hist_add (&churn.leave_lat, now_ns () - start);
+   churn.leaves++;
+
+   churn.idle[(churn.head + churn.nidle++) % churn.num] = g - churn.groups;
+}
+
+static void churn_join (struct timer *t)
+{
+   uint64_t now = now_ns ();
+
+   /* Catch up on all join events due, several per tick at high rates */
+   while (churn.join.next <= now)
+   {
+      struct group *g;
+      uint64_t start, leave;
+      int i;
+
+      stream_next (&churn.join, churn.pattern);
+      if (!churn.nidle)
+      {
+         churn.missed++;        /* All groups joined, leaves lag behind */
+         continue;
+      }
+
+      if (churn.pattern == CHURN_RANDOM)
+      {
+         int r = (churn.head + (int)(drand48 () * churn.nidle)) % churn.num;
+
+         i = churn.idle[r];
+         churn.idle[r] = churn.idle[churn.head];
+      }
+      else
+         i = churn.idle[churn.head];
+      churn.head = (churn.head + 1) % churn.num;
+      churn.nidle--;
+
+      g = &churn.groups[i];
+      start = now_ns ();
+      if (pool_join (churn.pool, g))
+      {
+         churn.errors++;
+         churn.idle[(churn.head + churn.nidle++) % churn.num] = i;
+         continue;
+      }
+      hist_add (&churn.join_lat, now_ns () - start);
+      churn.joins++;
+
+      leave = stream_next (&churn.leave, churn.pattern) + churn.hold;
+      if (leave < now)
+         leave = now;
+      timer_add (&churn.wheel, &g->timer, leave);
+   }
+
+   timer_add (&churn.wheel, t, churn.join.next);
+}
+
+static int churn_run (struct pool *pool, struct group *groups, int num, int pattern,
+                      double rate, double leave_rate, int burst, double hold, double duration)
+{
+   unsigned long joins = 0, leaves = 0;
+   uint64_t start, end = 0, report;
+   int i;
+
+   memset (&churn, 0, sizeof (churn));
+   churn.pattern = pattern;
+   churn.pool = pool;
+   churn.groups = groups;
+   churn.num = num;
+   churn.hold = hold * 1e9;
+
+   churn.idle = calloc (num, sizeof (int));
+   if (!churn.idle)
+   {
+      perror ("Failed allocating churn state");
+      return 1;
+   }
+   for (i = 0; i < num; i++)
+   {
+      churn.idle[i] = i;
+      groups[i].timer.cb = churn_leave;
+   }
+   churn.nidle = num;
+
+   wheel_init (&churn.wheel);
+   start = now_ns ();
+   churn.join.rate = rate;
+   churn.join.burst = burst;
+   churn.join.next = start;
+   churn.leave.rate = leave_rate;
+   churn.leave.burst = burst;
+   churn.leave.next = start;
+   churn.timer.cb = churn_join;
+   timer_add (&churn.wheel, &churn.timer, start);
+
+   if (duration > 0)
+      end = start + duration * 1e9;
+   report = start + 1000000000ULL;
+
+   printf ("Churning %d groups, %.0f joins/sec, %.0f leaves/sec, hold %.3f sec\n",
+           num, rate, leave_rate, hold);
+   printf ("%8s %10s %10s %8s %8s\n", "Time", "Joins/s", "Leaves/s", "Joined", "Missed");
+   while (running)
+   {
+      uint64_t now;
+
+      wheel_sleep (&churn.wheel);
+      now = now_ns ();
+      wheel_run (&churn.wheel, now);
+
+      if (now >= report)
+      {
+         printf ("%8.1f %10lu %10lu %8d %8lu\n", (now - start) / 1e9,
+                 churn.joins - joins, churn.leaves - leaves,
+                 num - churn.nidle, churn.missed);
+         fflush (stdout);
+         joins = churn.joins;
+         leaves = churn.leaves;
+         report += 1000000000ULL;
+      }
+
+      if (end && now >= end)
+         break;
+   }
+
+   {
+      double elapsed = (now_ns () - start) / 1e9;
+
+      printf ("\nAchieved %.1f joins/sec, %.1f leaves/sec over %.3f sec, %lu missed, %lu errors\n",
+              churn.joins / elapsed, churn.leaves / elapsed, elapsed, churn.missed, churn.errors);
+      printf ("setsockopt() latency in usec:\n");
+      hist_print ("  join", &churn.join_lat);
+      hist_print ("  leave", &churn.leave_lat);
+   }
+   free (churn.idle);
+
+   return 0;
+}
+
+/*
+ * The kernel sends IGMPv3 and MLDv2 state change reports on its own,
+ * and repeats them robustness times, so count what actually leaves the
+ * interface.  A packet socket sees outgoing frames, a filter keeps it
+ * to IGMP, and to IPv6 with a hop-by-hop header, which MLD always has.
+ */
+static int report_open (int ifindex)
+{
+   struct sock_filter code[] = {
+      BPF_STMT (BPF_LD  | BPF_H   | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+      BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 2),
+      BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 9),
+      BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IGMP, 3, 4),
+      BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 3),
+      BPF_STMT (BPF_LD  | BPF_B   | BPF_ABS, 6),
+      BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_HOPOPTS, 0, 1),
+      BPF_STMT (BPF_RET | BPF_K, 0xffff),
+      BPF_STMT (BPF_RET | BPF_K, 0),
+   };
+   struct sock_fprog prog = { sizeof (code) / sizeof (code[0]), code };
+   struct sockaddr_ll sll;
+   int sd, size = 4 << 20;
+
+   sd = socket (AF_PACKET, SOCK_DGRAM, htons (ETH_P_ALL));
+   if (sd < 0)
+   {
+      fprintf (stderr, "%s: Not counting IGMP reports, must be root: %s\n", __FUNCTION__, strerror (errno));
+      return -1;
+   }
+
+   memset (&sll, 0, sizeof (sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons (ETH_P_ALL);
+   sll.sll_ifindex = ifindex;
+   if (setsockopt (sd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof (prog)) ||
+       bind (sd, (struct sockaddr *)&sll, sizeof (sll)))
+   {
+      fprintf (stderr, "%s: Failed setting up packet socket: %s\n", __FUNCTION__, strerror (errno));
+      close (sd);
+      return -1;
+   }
+   if (setsockopt (sd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof (size)))
+      setsockopt (sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+   fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) | O_NONBLOCK);
+
+   return sd;
+}
+
+/* Offset of the MLD message in an IPv6 packet, or 0 if not MLD */
+static size_t report_mld (const unsigned char *buf, ssize_t len)
+{
+   size_t off;
+
+   if (len < 48 || (buf[0] >> 4) != 6 || buf[6] != IPPROTO_HOPOPTS || buf[40] != IPPROTO_ICMPV6)
+      return 0;
+
+   off = 40 + (buf[41] + 1) * 8;
+   if ((size_t)len < off + 8)
+      return 0;
+
+   return off;
+}
+
+/* Count our own IGMPv3/MLDv2 reports until the interface has been quiet for @quiet sec */
+static void report_count (int sd, int family, char *iface, double quiet)
+{
+   unsigned long reports = 0, records = 0;
+   uint64_t idle = now_ns () + quiet * 1e9;
+   unsigned char buf[2048];
+   struct sockaddr_ll sll;
+
+   while (running && now_ns () < idle)
+   {
+      socklen_t slen = sizeof (sll);
+      ssize_t len;
+      size_t hlen;
+
+      len = recvfrom (sd, buf, sizeof (buf), 0, (struct sockaddr *)&sll, &slen);
+      if (len < 0)
+      {
+         usleep (1000);
+         continue;
+      }
+      if (sll.sll_pkttype != PACKET_OUTGOING || len < 20)
+         continue;
+
+      if (family == AF_INET6)
+      {
+         hlen = report_mld (buf, len);
+         if (!hlen || buf[hlen] != 143)
+            continue;
+      }
+      else
+      {
+         hlen = (buf[0] & 0x0f) * 4;
+         if ((buf[0] >> 4) != 4 || (size_t)len < hlen + 8 || buf[hlen] != 0x22)
+            continue;
+      }
+
+      reports++;
+      records += buf[hlen + 6] << 8 | buf[hlen + 7];
+      idle = now_ns () + quiet * 1e9;
+   }
+
+   printf ("Sent %lu %s reports with %lu group records on %s\n", reports,
+           family == AF_INET ? "IGMPv3" : "MLDv2", records, iface);
+   fflush (stdout);
+}
+
+static uint64_t realtime_ns (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_REALTIME, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void group_key (const struct sockaddr_storage *ss, unsigned char *key)
+{
+   sa_family_t family;
+
+   /* Filled in as sockaddr_in/in6 by callers, don't read it back as storage */
+   memcpy (&family, &ss->ss_family, sizeof (family));
+
+   memset (key, 0, 16);
+   if (family == AF_INET)
+   {
+      key[10] = key[11] = 0xff;
+      memcpy (&key[12], &((struct sockaddr_in *)ss)->sin_addr, 4);
+   }
+   else
+      memcpy (key, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+}
+
+static int gkey_cmp (const void *a, const void *b)
+{
+   return memcmp (((const struct gkey *)a)->addr, ((const struct gkey *)b)->addr, 16);
+}
+
+static struct gkey *gkey_build (struct group *groups, int num)
+{
+   struct gkey *index;
+   int i;
+
+   index = calloc (num, sizeof (struct gkey));
+   if (!index)
+      return NULL;
+
+   for (i = 0; i < num; i++)
+   {
+      group_key (&groups[i].addr, index[i].addr);
+      index[i].idx = i;
+   }
+   qsort (index, num, sizeof (struct gkey), gkey_cmp);
+
+   return index;
+}
+
+static struct group *gkey_find (struct gkey *index, struct group *groups, int num, struct sockaddr_storage *ss)
+{
+   struct gkey key, *found;
+
+   group_key (ss, key.addr);
+   found = bsearch (&key, index, num, sizeof (struct gkey), gkey_cmp);
+   if (!found)
+      return NULL;
+
+   return &groups[found->idx];
+}
+
+/*
+ * A packet socket in ALLMULTI mode sees group traffic the network still
+ * sends after we have left, which the host's own multicast filter hides
+ * from UDP sockets.  This is what the leave to last packet time needs.
+ */
+static int monitor_open (struct pool *pool)
+{
+   struct packet_mreq mr;
+   struct sockaddr_ll sll;
+   struct epoll_event ev;
+   int sd, on = 1;
+
+   sd = socket (AF_PACKET, SOCK_DGRAM, htons (pool->family == AF_INET ? ETH_P_IP : ETH_P_IPV6));
+   if (sd < 0)
+   {
+      fprintf (stderr, "%s: Failed opening packet socket, must be root: %s\n", __FUNCTION__, strerror (errno));
+      return -1;
+   }
+
+   memset (&sll, 0, sizeof (sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons (pool->family == AF_INET ? ETH_P_IP : ETH_P_IPV6);
+   sll.sll_ifindex = pool->ifindex;
+   if (bind (sd, (struct sockaddr *)&sll, sizeof (sll)))
+      goto fail;
+
+   memset (&mr, 0, sizeof (mr));
+   mr.mr_ifindex = pool->ifindex;
+   mr.mr_type = PACKET_MR_ALLMULTI;
+   if (setsockopt (sd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof (mr)))
+      goto fail;
+
+   setsockopt (sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on));
+   fcntl (sd, F_SETFL, fcntl (sd, F_GETFL) | O_NONBLOCK);
+
+   ev.events = EPOLLIN;
+   ev.data.fd = MONITOR;
+   if (epoll_ctl (pool->epfd, EPOLL_CTL_ADD, sd, &ev))
+      goto fail;
+
+   return sd;
+fail:
+   fprintf (stderr, "%s: Failed setting up packet socket: %s\n", __FUNCTION__, strerror (errno));
+   close (sd);
+   return -1;
+}
+
+/* Read one packet, its kernel timestamp and, for UDP sockets, destination */
+static ssize_t measure_recv (int sd, char *buf, size_t len, uint64_t *ts, struct sockaddr_storage *dst)
+{
+   char cbuf[CMSG_SPACE (sizeof (struct timespec)) + CMSG_SPACE (sizeof (struct in_pktinfo))];
+   struct iovec iov = { buf, len };
+   struct cmsghdr *cmsg;
+   struct msghdr msg;
+   ssize_t num;
+
+   memset (&msg, 0, sizeof (msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cbuf;
+   msg.msg_controllen = sizeof (cbuf);
+
+   num = recvmsg (sd, &msg, 0);
+   if (num < 0)
+      return num;
+
+   *ts = 0;
+   for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+   {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      {
+         struct timespec t;
+
+         memcpy (&t, CMSG_DATA (cmsg), sizeof (t));
+         *ts = (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+      }
+      if (dst && cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+      {
+         struct in_pktinfo pi;
+         struct sockaddr_in *sin = (struct sockaddr_in *)dst;
+
+         memcpy (&pi, CMSG_DATA (cmsg), sizeof (pi));
+         sin->sin_family = AF_INET;
+         sin->sin_addr = pi.ipi_addr;
+      }
+   }
+   if (!*ts)
+      *ts = realtime_ns ();
+
+   return num;
+}
+
+/* Destination of a UDP packet to our port seen on the packet socket */
+static int monitor_parse (const unsigned char *p, ssize_t len, int port, struct sockaddr_storage *dst)
+{
+   memset (dst, 0, sizeof (*dst));
+   if (len >= 28 && (p[0] >> 4) == 4 && p[9] == IPPROTO_UDP)
+   {
+      size_t hlen = (p[0] & 0x0f) * 4;
+      struct sockaddr_in *sin = (struct sockaddr_in *)dst;
+
+      if ((size_t)len < hlen + 8 || (p[hlen + 2] << 8 | p[hlen + 3]) != port)
+         return 1;
+      sin->sin_family = AF_INET;
+      memcpy (&sin->sin_addr, &p[16], 4);
+
+      return 0;
+   }
+
+   return 1;
+}
+
+static int cmp_u64 (const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+   return (x > y) - (x < y);
+}
+
+static void print_percentiles (const char *name, uint64_t *val, int num, int total)
+{
+   const double pct[] = { 0.0, 50.0, 90.0, 99.0, 100.0 };
+   const char *label[] = { "min", "p50", "p90", "p99", "max" };
+   size_t i;
+
+   printf ("%-24s %6d of %6d groups", name, num, total);
+   if (num)
+   {
+      qsort (val, num, sizeof (uint64_t), cmp_u64);
+      for (i = 0; i < sizeof (pct) / sizeof (pct[0]); i++)
+         printf (", %s %.3f", label[i], val[(int)((num - 1) * pct[i] / 100.0 + 0.5)] / 1e6);
+      printf (" ms");
+   }
+   printf ("\n");
+}
+
+/*
+ * Wait for traffic on all bound pool sockets and the packet monitor.
+ * Before leaving, the first packet of each group is recorded.  After,
+ * the last one seen on the wire.  Returns when all groups have been
+ * heard from, or when nothing relevant has happened for @timeout.
+ * Traffic that never stops after a leave, no snooping or no prune,
+ * would keep pushing that on, so leaving also ends LEAVE_MAX timeouts
+ * after it started whatever arrives.
+ */
+static void measure_loop (struct pool *pool, int monitor, struct gkey *index,
+                          struct group *groups, int num, int leaving, double timeout)
+{
+   struct epoll_event events[MAXEVENTS];
+   uint64_t idle = now_ns () + timeout * 1e9;
+   uint64_t deadline = leaving ? now_ns () + LEAVE_MAX * timeout * 1e9 : UINT64_MAX;
+   int pending = num;
+   char buf[2048];
+
+   while (running && now_ns () < idle && now_ns () < deadline && (leaving || pending > 0))
+   {
+      int i, n;
+
+      n = epoll_wait (pool->epfd, events, MAXEVENTS, 100);
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         perror ("epoll_wait");
+         return;
+      }
+
+      for (i = 0; i < n; i++)
+      {
+         int sd = events[i].data.fd == MONITOR ? monitor : events[i].data.fd;
+         struct sockaddr_storage dst;
+         struct group *g;
+         uint64_t ts;
+         ssize_t len;
+
+         while ((len = measure_recv (sd, buf, sizeof (buf), &ts, &dst)) >= 0)
+         {
+            if (sd == monitor)
+            {
+               if (!leaving || monitor_parse ((unsigned char *)buf, len, pool->port, &dst))
+                  continue;
+            }
+            else if (leaving)
+               continue;
+
+            g = gkey_find (index, groups, num, &dst);
+            if (!g)
+               continue;
+
+            if (!leaving && !g->first && sd != monitor)
+            {
+               g->first = ts;
+               pending--;
+               idle = now_ns () + timeout * 1e9;
+            }
+            if (leaving && g->left && ts > g->left)
+            {
+               g->last = ts;
+               idle = now_ns () + timeout * 1e9;
+            }
+         }
+      }
+   }
+}
+
+static int measure_run (struct pool *pool, char *iface, struct group *groups, int num, double timeout)
+{
+   struct gkey *index;
+   uint64_t *val, end;
+   int i, n, flowing, monitor;
+
+   index = gkey_build (groups, num);
+   val = calloc (num, sizeof (uint64_t));
+   if (!index || !val)
+   {
+      perror ("Failed allocating measurement state");
+      return 1;
+   }
+
+   monitor = monitor_open (pool);
+   if (monitor < 0)
+      return 1;
+
+   for (i = 0; i < num; i++)
+   {
+      groups[i].joined = realtime_ns ();
+      if (pool_join (pool, &groups[i]))
+         return 1;
+   }
+   printf ("Joined %d groups on %s, waiting for first packets on port %d ...\n", num, iface, pool->port);
+   fflush (stdout);
+   measure_loop (pool, monitor, index, groups, num, 0, timeout);
+
+   for (i = 0; i < num; i++)
+   {
+      groups[i].left = realtime_ns ();
+      pool_leave (pool, &groups[i]);
+   }
+   printf ("Left %d groups, waiting %.1f sec (at most %.1f) for traffic to stop ...\n",
+           num, timeout, LEAVE_MAX * timeout);
+   fflush (stdout);
+   measure_loop (pool, monitor, index, groups, num, 1, timeout);
+   end = realtime_ns ();
+
+   printf ("\n");
+   for (i = n = 0; i < num; i++)
+   {
+      if (groups[i].first)
+         val[n++] = groups[i].first > groups[i].joined ? groups[i].first - groups[i].joined : 0;
+   }
+   print_percentiles ("Join to first packet", val, n, num);
+
+   /* Heard from within the last timeout, it never stopped */
+   for (i = n = flowing = 0; i < num; i++)
+   {
+      if (!groups[i].first)
+         continue;
+      if (groups[i].last && end - groups[i].last < timeout * 1e9)
+      {
+         DEBUG("Group %s still flowing after leave\n", group_str (&groups[i]));
+         flowing++;
+         continue;
+      }
+      val[n++] = groups[i].last ? groups[i].last - groups[i].left : 0;
+   }
+   print_percentiles ("Leave to last packet", val, n, num);
+   if (flowing)
+      printf ("%-24s %6d of %6d groups, no leave latency\n", "Still flowing", flowing, num);
+
+   close (monitor);
+   free (index);
+   free (val);
+
+   return 0;
+}
+
+/*
+ * Host emulator.  Joining through the stack is one host per interface,
+ * so here IGMP reports are built by hand for --emulate hosts, each with
+ * its own source address and MAC, and written into a PACKET_MMAP TX
+ * ring that is kicked off in batches.  Unsolicited reports are paced
+ * at --rate.  Queries are answered by every emulated host after a
+ * random delay within the max response time, as a real stack does,
+ * with one timer per host on the wheel.
+ */
+#define EMU_BASE      0x0a000001       /* 10.0.0.1 */
+#define EMU_FRAME     2048
+#define EMU_BLOCK     (1 << 16)
+#define EMU_BLOCKS    32
+#define EMU_BATCH     64               /* Frames queued before kicking the ring */
+#define EMU_DATA      TPACKET_ALIGN (sizeof (struct tpacket2_hdr))
+
+#define ALL_ROUTERS   0xe0000002       /* IGMPv2 leave */
+#define V3_ROUTERS    0xe0000016       /* IGMPv3 reports */
+
+/* IGMPv3 group record types, RFC 3376 */
+enum { IS_IN = 1, IS_EX, TO_IN, TO_EX, ALLOW, BLOCK };
+
+struct host
+{
+   uint32_t addr;               /* Host byte order */
+   struct timer timer;          /* Query response */
+   uint32_t query;              /* Group queried, 0 for general */
+   uint64_t deadline;           /* nsec, end of max response time */
+};
+
+struct emu
+{
+   int version;
+   int tx, rx;
+   unsigned char *ring;
+   size_t size;
+   unsigned int frame, frames;  /* Next free frame, total */
+   int queued;                  /* Frames not yet kicked off */
+   uint16_t id;
+
+   struct group *groups;
+   struct gkey *index;
+   int num;
+   int per;                     /* Group records per IGMPv3 report */
+
+   struct host *hosts;
+   int nhosts;
+
+   struct wheel wheel;
+   struct timer timer;          /* Unsolicited report stream */
+   struct stream stream;
+   int host, group;             /* Next unsolicited report */
+   uint64_t done;               /* nsec, all hosts joined */
+
+   unsigned long reports, queries, responses, late, full;
+   struct histogram timer_lat;
+} emu;
+
+static uint16_t inet_csum (const void *buf, size_t len)
+{
+   const unsigned char *p = buf;
+   uint32_t sum = 0;
+
+   while (len > 1)
+   {
+      sum += p[0] << 8 | p[1];
+      p += 2;
+      len -= 2;
+   }
+   if (len)
+      sum += p[0] << 8;
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+
+   return htons (~sum & 0xffff);
+}
+
+static void emu_flush (int wait)
+{
+   if (!emu.queued && !wait)
+      return;
+
+   if (send (emu.tx, NULL, 0, wait ? 0 : MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS)
+      fprintf (stderr, "%s: Failed sending TX ring: %s\n", __FUNCTION__, strerror (errno));
+   emu.queued = 0;
+}
+
+/* Start a frame from @h to @dst, returns where the IGMP message goes */
+static unsigned char *emu_start (struct host *h, uint32_t dst)
+{
+   struct tpacket2_hdr *hdr;
+   unsigned char *p;
+
+   hdr = (struct tpacket2_hdr *)(emu.ring + emu.frame * EMU_FRAME);
+   if (hdr->tp_status != TP_STATUS_AVAILABLE)
+   {
+      emu.full++;
+      emu_flush (1);           /* Ring full, wait for the kernel to catch up */
+      while (hdr->tp_status != TP_STATUS_AVAILABLE)
+         usleep (10);
+   }
+
+   p = (unsigned char *)hdr + EMU_DATA;
+
+   /* Ethernet, multicast MAC of destination, locally administered source */
+   p[0] = 0x01;
+   p[1] = 0x00;
+   p[2] = 0x5e;
+   p[3] = (dst >> 16) & 0x7f;
+   p[4] = (dst >> 8) & 0xff;
+   p[5] = dst & 0xff;
+   p[6] = 0x02;
+   p[7] = 0x00;
+   p[8] = h->addr >> 24;
+   p[9] = h->addr >> 16;
+   p[10] = h->addr >> 8;
+   p[11] = h->addr;
+   p[12] = ETH_P_IP >> 8;
+   p[13] = ETH_P_IP & 0xff;
+
+   /* IPv4 with Router Alert, TTL 1, as required for IGMP */
+   p += 14;
+   memset (p, 0, 24);
+   p[0] = 0x46;
+   p[1] = 0xc0;
+   p[4] = emu.id >> 8;
+   p[5] = emu.id++;
+   p[6] = 0x40;                 /* DF */
+   p[8] = 1;
+   p[9] = IPPROTO_IGMP;
+   p[12] = h->addr >> 24;
+   p[13] = h->addr >> 16;
+   p[14] = h->addr >> 8;
+   p[15] = h->addr;
+   p[16] = dst >> 24;
+   p[17] = dst >> 16;
+   p[18] = dst >> 8;
+   p[19] = dst;
+   p[20] = 0x94;
+   p[21] = 0x04;
+
+   return p + 24;
+}
+
+/* Checksum and queue the frame started with emu_start() */
+static void emu_finish (unsigned char *igmp, size_t len)
+{
+   struct tpacket2_hdr *hdr = (struct tpacket2_hdr *)(emu.ring + emu.frame * EMU_FRAME);
+   unsigned char *ip = igmp - 24;
+   uint16_t sum;
+
+   sum = inet_csum (igmp, len);
+   memcpy (&igmp[2], &sum, 2);
+
+   ip[2] = (24 + len) >> 8;
+   ip[3] = (24 + len) & 0xff;
+   sum = inet_csum (ip, 24);
+   memcpy (&ip[10], &sum, 2);
+
+   hdr->tp_len = 14 + 24 + len;
+   __atomic_store_n (&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+   emu.frame = (emu.frame + 1) % emu.frames;
+   emu.reports++;
+
+   if (++emu.queued >= EMU_BATCH)
+      emu_flush (0);
+}
+
+static uint32_t emu_group (int i)
+{
+   return ntohl (((struct sockaddr_in *)&emu.groups[i].addr)->sin_addr.s_addr);
+}
+
+/* IGMPv3 report with @count records, from group @first.  SSM sources map ASM record types */
+static void emu_v3 (struct host *h, int type, int first, int count)
+{
+   unsigned char *igmp, *p;
+   int i, j;
+
+   if (nsources)
+      type = type == IS_EX ? IS_IN : type == TO_EX ? ALLOW : BLOCK;
+
+   igmp = emu_start (h, V3_ROUTERS);
+   memset (igmp, 0, 8);
+   igmp[0] = 0x22;
+   igmp[6] = count >> 8;
+   igmp[7] = count & 0xff;
+
+   p = igmp + 8;
+   for (i = first; i < first + count; i++)
+   {
+      uint32_t group = emu_group (i);
+
+      p[0] = type;
+      p[1] = 0;
+      p[2] = nsources >> 8;
+      p[3] = nsources & 0xff;
+      p[4] = group >> 24;
+      p[5] = group >> 16;
+      p[6] = group >> 8;
+      p[7] = group;
+      p += 8;
+      for (j = 0; j < nsources; j++, p += 4)
+         memcpy (p, &((struct sockaddr_in *)&sources[j])->sin_addr, 4);
+   }
+
+   emu_finish (igmp, p - igmp);
+}
+
+/* IGMPv2 report, or leave, for group @i */
+static void emu_v2 (struct host *h, int leave, int i)
+{
+   uint32_t group = emu_group (i);
+   unsigned char *igmp;
+
+   igmp = emu_start (h, leave ? ALL_ROUTERS : group);
+   memset (igmp, 0, 8);
+   igmp[0] = leave ? 0x17 : 0x16;
+   igmp[4] = group >> 24;
+   igmp[5] = group >> 16;
+   igmp[6] = group >> 8;
+   igmp[7] = group;
+
+   emu_finish (igmp, 8);
+}
+
+/* Report, or leave, all groups of host @h */
+static void emu_host (struct host *h, int type)
+{
+   int i;
+
+   for (i = 0; i < emu.num; i += emu.version == 3 ? emu.per : 1)
+   {
+      if (emu.version == 3)
+         emu_v3 (h, type, i, emu.num - i < emu.per ? emu.num - i : emu.per);
+      else
+         emu_v2 (h, type == TO_IN, i);
+   }
+}
+
+static void emu_respond (struct timer *t)
+{
+   struct host *h = (struct host *)((char *)t - offsetof (struct host, timer));
+   uint64_t now = now_ns ();
+
+   hist_add (&emu.timer_lat, now > t->expires ? now - t->expires : 0);
+   if (now > h->deadline)
+      emu.late++;
+   emu.responses++;
+
+   if (!h->query)
+   {
+      emu_host (h, IS_EX);
+      return;
+   }
+
+   {
+      struct sockaddr_storage ss;
+      struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+      struct group *g;
+
+      memset (&ss, 0, sizeof (ss));
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl (h->query);
+      g = gkey_find (emu.index, emu.groups, emu.num, &ss);
+      if (!g)
+         return;
+
+      if (emu.version == 3)
+         emu_v3 (h, IS_EX, g - emu.groups, 1);
+      else
+         emu_v2 (h, 0, g - emu.groups);
+   }
+}
+
+/* Unsolicited reports, one per event, host by host */
+static void emu_join (struct timer *t)
+{
+   uint64_t now = now_ns ();
+
+   while (emu.stream.next <= now && emu.host < emu.nhosts)
+   {
+      struct host *h = &emu.hosts[emu.host];
+      int count = 1;
+
+      stream_next (&emu.stream, CHURN_STEADY);
+      if (emu.version == 3)
+      {
+         count = emu.num - emu.group < emu.per ? emu.num - emu.group : emu.per;
+         emu_v3 (h, TO_EX, emu.group, count);
+      }
+      else
+         emu_v2 (h, 0, emu.group);
+
+      emu.group += count;
+      if (emu.group >= emu.num)
+      {
+         emu.group = 0;
+         emu.host++;
+      }
+   }
+
+   if (emu.host < emu.nhosts)
+      timer_add (&emu.wheel, t, emu.stream.next);
+   else
+      emu.done = now;
+}
+
+/* Max response time of a query in nsec, or 0 if not a query */
+static uint64_t emu_maxresp (const unsigned char *ip, ssize_t len, uint32_t *group)
+{
+   const unsigned char *igmp;
+   size_t hlen, ilen;
+   int code;
+
+   hlen = (ip[0] & 0x0f) * 4;
+   if (len < 20 || (size_t)len < hlen + 8 || ip[9] != IPPROTO_IGMP)
+      return 0;
+
+   igmp = ip + hlen;
+   ilen = (ip[2] << 8 | ip[3]) - hlen;
+   if (igmp[0] != 0x11)
+      return 0;
+
+   *group = igmp[4] << 24 | igmp[5] << 16 | igmp[6] << 8 | igmp[7];
+   code = igmp[1];
+   if (ilen >= 12 && code >= 128)
+      code = ((code & 0x0f) | 0x10) << (((code >> 4) & 0x07) + 3);
+   if (!code)
+      code = 100;               /* IGMPv1, 10 sec */
+
+   return code * 100000000ULL;
+}
+
+static void emu_query (const unsigned char *ip, ssize_t len, uint64_t now)
+{
+   uint64_t maxresp;
+   uint32_t group = 0;
+   int i;
+
+   maxresp = emu_maxresp (ip, len, &group);
+   if (!maxresp)
+      return;
+
+   if (group)
+   {
+      struct sockaddr_storage ss;
+      struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+      memset (&ss, 0, sizeof (ss));
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl (group);
+      if (!gkey_find (emu.index, emu.groups, emu.num, &ss))
+         return;
+   }
+   emu.queries++;
+
+   /* Only hosts that have joined answer, a pending response is widened to general */
+   for (i = 0; i < emu.nhosts && i < emu.host; i++)
+   {
+      struct host *h = &emu.hosts[i];
+
+      if (h->timer.armed)
+      {
+         if (h->query != group)
+            h->query = 0;
+         continue;
+      }
+
+      h->query = group;
+      h->deadline = now + maxresp;
+      timer_add (&emu.wheel, &h->timer, now + (uint64_t)(drand48 () * maxresp));
+   }
+}
+
+static int emu_open (int ifindex)
+{
+   struct tpacket_req req;
+   struct sockaddr_ll sll;
+   struct packet_mreq mr;
+   int val;
+
+   emu.tx = socket (AF_PACKET, SOCK_RAW, 0);
+   if (emu.tx < 0)
+   {
+      fprintf (stderr, "%s: Failed opening packet socket, must be root: %s\n", __FUNCTION__, strerror (errno));
+      return 1;
+   }
+
+   val = TPACKET_V2;
+   if (setsockopt (emu.tx, SOL_PACKET, PACKET_VERSION, &val, sizeof (val)))
+      goto fail;
+
+   req.tp_block_size = EMU_BLOCK;
+   req.tp_block_nr = EMU_BLOCKS;
+   req.tp_frame_size = EMU_FRAME;
+   req.tp_frame_nr = EMU_BLOCK / EMU_FRAME * EMU_BLOCKS;
+   if (setsockopt (emu.tx, SOL_PACKET, PACKET_TX_RING, &req, sizeof (req)))
+      goto fail;
+
+   emu.size = (size_t)EMU_BLOCK * EMU_BLOCKS;
+   emu.frames = req.tp_frame_nr;
+   emu.ring = mmap (NULL, emu.size, PROT_READ | PROT_WRITE, MAP_SHARED, emu.tx, 0);
+   if (emu.ring == MAP_FAILED)
+      goto fail;
+
+   memset (&sll, 0, sizeof (sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons (ETH_P_IP);
+   sll.sll_ifindex = ifindex;
+   if (bind (emu.tx, (struct sockaddr *)&sll, sizeof (sll)))
+      goto fail;
+
+   /* Queries, also group-specific ones to groups the stack has not joined */
+   emu.rx = report_open (ifindex);
+   if (emu.rx < 0)
+      return 1;
+
+   memset (&mr, 0, sizeof (mr));
+   mr.mr_ifindex = ifindex;
+   mr.mr_type = PACKET_MR_ALLMULTI;
+   val = 1;
+   if (setsockopt (emu.rx, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof (mr)) ||
+       setsockopt (emu.rx, SOL_PACKET, PACKET_IGNORE_OUTGOING, &val, sizeof (val)))
+      goto fail;
+
+   return 0;
+fail:
+   fprintf (stderr, "%s: Failed setting up packet sockets: %s\n", __FUNCTION__, strerror (errno));
+   return 1;
+}
+
+static int emu_mtu (int ifindex)
+{
+   struct ifreq ifr;
+
+   memset (&ifr, 0, sizeof (ifr));
+   if (!if_indextoname (ifindex, ifr.ifr_name) || ioctl (emu.tx, SIOCGIFMTU, &ifr))
+      return 1500;
+
+   return ifr.ifr_mtu;
+}
+
+static int emu_run (struct pool *pool, char *iface, struct group *groups, int num, int nhosts,
+                    uint32_t base, int version, double rate, double duration)
+{
+   unsigned long reports = 0, responses = 0;
+   uint64_t start, end = 0, report;
+   int i;
+
+   memset (&emu, 0, sizeof (emu));
+   emu.version = version;
+   emu.groups = groups;
+   emu.num = num;
+   emu.nhosts = nhosts;
+
+   emu.index = gkey_build (groups, num);
+   emu.hosts = calloc (nhosts, sizeof (struct host));
+   if (!emu.index || !emu.hosts)
+   {
+      perror ("Failed allocating host table");
+      return 1;
+   }
+   for (i = 0; i < nhosts; i++)
+   {
+      emu.hosts[i].addr = base + i;
+      emu.hosts[i].timer.cb = emu_respond;
+   }
+
+   if (emu_open (pool->ifindex))
+      return 1;
+
+   emu.per = (emu_mtu (pool->ifindex) - 24 - 8) / (8 + 4 * nsources);
+   if (version == 3 && emu.per < 1)
+   {
+      fprintf (stderr, "Too many sources for one group record in an MTU sized report\n");
+      return 1;
+   }
+
+   wheel_init (&emu.wheel);
+   start = now_ns ();
+   emu.stream.rate = rate;
+   emu.stream.burst = 1;
+   emu.stream.next = start;
+   emu.timer.cb = emu_join;
+   timer_add (&emu.wheel, &emu.timer, start);
+
+   if (duration > 0)
+      end = start + duration * 1e9;
+   report = start + 1000000000ULL;
+
+   printf ("Emulating %d IGMPv%d hosts from %s on %s, %d groups each, %.0f reports/sec\n",
+           nhosts, version, inet_ntoa ((struct in_addr){ htonl (base) }), iface, num, rate);
+   printf ("%8s %10s %8s %10s %8s %8s\n", "Time", "Reports/s", "Queries", "Responses", "Late", "Joined");
+   while (running)
+   {
+      struct pollfd pfd = { emu.rx, POLLIN, 0 };
+      uint64_t now = now_ns (), next = emu.wheel.tick * WHEEL_TICK;
+      struct timespec ts = { 0, 0 };
+
+      if (next > now)
+         ts.tv_nsec = next - now;
+      if (ppoll (&pfd, 1, &ts, NULL) > 0)
+      {
+         unsigned char buf[2048];
+         ssize_t len;
+
+         while ((len = recv (emu.rx, buf, sizeof (buf), 0)) > 0)
+            emu_query (buf, len, now_ns ());
+      }
+
+      now = now_ns ();
+      wheel_run (&emu.wheel, now);
+      emu_flush (0);
+
+      if (now >= report)
+      {
+         printf ("%8.1f %10lu %8lu %10lu %8lu %8d\n", (now - start) / 1e9,
+                 emu.reports - reports, emu.queries, emu.responses - responses,
+                 emu.late, emu.host);
+         fflush (stdout);
+         reports = emu.reports;
+         responses = emu.responses;
+         report += 1000000000ULL;
+      }
+
+      if (end && now >= end)
+         break;
+   }
+
+   if (emu.done)
+      printf ("\nAll %d hosts joined in %.3f sec\n", nhosts, (emu.done - start) / 1e9);
 
-#define DEFAULT_GROUP 0x0e010203
+   /* Leave for all hosts that joined, as fast as the ring takes them */
+   for (i = 0; i < emu.host; i++)
+      emu_host (&emu.hosts[i], TO_IN);
+   emu_flush (1);
 
-/* Program meta data */
-const char *doc = "Multicast Join Group Test Program";
-const char *program_version = "$Date: 2007-01-30 23:33:08 +0100 (Tue, 30 Jan 2007) $ $Rev: 4070 $";
-const char *program_bug_address = "Joachim Nilsson <troglobit at gmail.com>";
+   printf ("Sent %lu reports, answered %lu queries with %lu responses, %lu late, TX ring full %lu times\n",
+           emu.reports, emu.queries, emu.responses, emu.late, emu.full);
+   printf ("Response timer latency in usec:\n");
+   hist_print ("  response", &emu.timer_lat);
 
-/* Mode flags */
-int quiet = 0;
-int verbose = 0;
+   munmap (emu.ring, emu.size);
+   close (emu.tx);
+   close (emu.rx);
+   free (emu.hosts);
+   free (emu.index);
 
-/* getopt externals */
-extern int optind;
+   return 0;
+}
 
-static int usage (char *name)
+/*
+ * One worker per interface.  Each has its own group table and socket
+ * pool, so joins on different interfaces run in parallel and setup is
+ * done in the time of the slowest one.  The main thread reports their
+ * progress while they run.
+ */
+struct worker
 {
-   fprintf (stderr,
-            "%s\n"
-            "-------------------------------------------------------------------------------\n"
-            "Usage: %s  [OPTIONS] [-i iface] [-f FIRST-MC-GROUP] [-n TOTAL-GROUPS] [GROUP0 .. GROUPN]\n"
-            "Mandatory arguments to long options are mandatory for short options too.\n"
-            "\n"
-            "Options:\n"
-            " -f, --first-group=1.2.3.3          First Mulitcast group, e.g. 225.0.0.1\n"
-            " -n, --groups=N                     Total number of Mulitcast groups, e.g. 50\n"
-            " -i, --interface=iface              Interface to subscribe groups on.\n"
-            " -q, --quiet                        Quiet mode.\n"
-            " -v, --version                      Display program version.\n"
-            " -?, --help                         This help text.\n"
-            "-------------------------------------------------------------------------------\n"
-            "Copyright (C) 2004  %s\n"
-            "\n",
-            doc, basename (name), program_bug_address);
+   char iface[IF_NAMESIZE];
+   char *spec;                  /* GROUP[/N], or NULL for the common set */
+   int family;
+   struct group *groups;
+   int num;
+   struct pool pool;
 
-   return 1;
+   pthread_t tid;
+   int done;                    /* Atomic */
+   int err;
+   uint64_t elapsed;            /* nsec */
+};
+
+/* Per-interface group set, "GROUP[/N]", N groups counting up from GROUP */
+static int worker_groups (struct worker *w)
+{
+   struct sockaddr_storage first;
+   char *count;
+   int i, num = 1;
+
+   count = strchr (w->spec, '/');
+   if (count)
+   {
+      *count++ = 0;
+      num = atoi (count);
+   }
+
+   w->family = addr_parse (w->spec, &first);
+   if (!w->family || num < 1)
+   {
+      fprintf (stderr, "Invalid group set %s for %s\n", w->spec, w->iface);
+      return 1;
+   }
+
+   w->groups = calloc (num, sizeof (struct group));
+   if (!w->groups)
+   {
+      perror ("Failed allocating group table");
+      return 1;
+   }
+   for (i = 0; i < num; i++)
+      group_set (&w->groups[i], &first, w->family, i);
+   w->num = num;
+
+   return 0;
+}
+
+static void *worker_join (void *arg)
+{
+   struct worker *w = arg;
+   uint64_t start = now_ns ();
+   int report = -1;
+
+   if (nsources)
+      report = report_open (w->pool.ifindex);
+
+   w->err = join_groups (&w->pool, w->iface, w->groups, w->num);
+   w->elapsed = now_ns () - start;
+   __atomic_store_n (&w->done, 1, __ATOMIC_RELEASE);
+
+   if (report >= 0)
+   {
+      char path[80];
+
+      /* Retransmits are spread over the unsolicited report interval */
+      if (w->family == AF_INET)
+         snprintf (path, sizeof (path), "/proc/sys/net/ipv4/conf/%s/igmpv3_unsolicited_report_interval", w->iface);
+      else
+         snprintf (path, sizeof (path), "/proc/sys/net/ipv6/conf/%s/mldv2_unsolicited_report_interval", w->iface);
+      if (!w->err)
+         report_count (report, w->family, w->iface, 2 * read_sysctl (path, 1000) / 1000.0);
+      close (report);
+   }
+
+   return NULL;
 }
 
-static int join_group (char *iface, char *group)
+static int join_all (struct worker *workers, int num)
 {
-   static int sock = 0, count = 0;
-   struct ip_mreqn mreqn;
+   uint64_t start, report;
+   unsigned long total = 0;
+   sigset_t set, old;
+   int i, err = 0, slowest = 0;
+
+   if (num == 1)
+   {
+      worker_join (&workers[0]);
+      return workers[0].err;
+   }
 
-  restart:
-   if (!sock)
+   /* Leave SIGINT and SIGTERM to the main thread, it is the one in pause() */
+   sigemptyset (&set);
+   sigaddset (&set, SIGINT);
+   sigaddset (&set, SIGTERM);
+   pthread_sigmask (SIG_BLOCK, &set, &old);
+
+   start = now_ns ();
+   for (i = 0; i < num; i++)
    {
-      sock = socket (PF_INET, SOCK_DGRAM, 0);
-      if (sock < 0)
+      if (pthread_create (&workers[i].tid, NULL, worker_join, &workers[i]))
       {
-         fprintf (stderr, "%s: Failed opening socket(): %s\n", __FUNCTION__, strerror(errno));
-         return 1;
+         fprintf (stderr, "Failed starting worker for %s\n", workers[i].iface);
+         num = i;
+         err = 1;
+         break;
       }
    }
-   else
+   pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+   report = start + 1000000000ULL;
+   while (1)
    {
-      /* Only IP_MAX_MEMBERSHIPS (20) number of groups allowed per socket. 
-       * http://lists.freebsd.org/pipermail/freebsd-net/2003-October/001726.html
-       */
-      if (++count >= IP_MAX_MEMBERSHIPS)
+      int done = 0;
+
+      for (i = 0; i < num; i++)
+         done += __atomic_load_n (&workers[i].done, __ATOMIC_ACQUIRE);
+      if (done == num)
+         break;
+
+      usleep (10000);
+      if (now_ns () < report)
+         continue;
+
+      printf ("Progress:");
+      for (i = 0; i < num; i++)
+         printf (" %s %lu/%d", workers[i].iface,
+                 __atomic_load_n (&workers[i].pool.progress, __ATOMIC_RELAXED), workers[i].num);
+      printf ("\n");
+      fflush (stdout);
+      report += 1000000000ULL;
+   }
+
+   for (i = 0; i < num; i++)
+   {
+      pthread_join (workers[i].tid, NULL);
+      if (workers[i].err)
+         err = 1;
+      if (workers[i].elapsed > workers[slowest].elapsed)
+         slowest = i;
+      total += workers[i].pool.progress;
+   }
+
+   printf ("Joined %lu groups on %d interfaces in %.3f sec, slowest %s %.3f sec\n",
+           total, num, (now_ns () - start) / 1e9, workers[slowest].iface, workers[slowest].elapsed / 1e9);
+   fflush (stdout);
+
+   return err;
+}
+
+/*
+ * Membership audit.  The kernel's view of what is joined is read back
+ * from /proc/net/igmp or /proc/net/igmp6, parsed in place in the read
+ * buffer into a sorted array of keys, and merged against the requested
+ * set.  /proc cannot be mmap()ed, so one read buffer is as close to
+ * zero copy as it gets.  There is no netlink dump of IPv4 memberships,
+ * so both families are audited the same way.
+ */
+static char *proc_read (const char *path, size_t *len)
+{
+   size_t size = 1 << 16;
+   char *buf = NULL, *tmp;
+   ssize_t num;
+   int fd;
+
+   fd = open (path, O_RDONLY);
+   if (fd < 0)
+      return NULL;
+
+   *len = 0;
+   while (1)
+   {
+      if (!buf || *len + 1 >= size)
       {
-         count = 0;
-         sock = 0;              /* XXX: No good, losing socket... */
-         goto restart;
+         if (buf)
+            size *= 2;
+         tmp = realloc (buf, size);
+         if (!tmp)
+            break;
+         buf = tmp;
       }
+
+      num = read (fd, buf + *len, size - *len - 1);
+      if (num <= 0)
+         break;
+      *len += num;
    }
+   close (fd);
+
+   if (buf)
+      buf[*len] = 0;
+
+   return buf;
+}
+
+static int hexval (int c)
+{
+   if (c >= '0' && c <= '9')
+      return c - '0';
+   c |= 0x20;
+   if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+
+   return -1;
+}
+
+/* Kernel memberships on @ifindex, sorted, returns how many or -1 */
+static int audit_parse (int family, int ifindex, struct gkey **out)
+{
+   struct gkey *keys = NULL, *tmp;
+   int num = 0, size = 0, idx = 0;
+   char *buf, *p, *end;
+   size_t len;
+
+   buf = proc_read (family == AF_INET ? "/proc/net/igmp" : "/proc/net/igmp6", &len);
+   if (!buf)
+      return -1;
 
-   memset (&mreqn, 0, sizeof (mreqn));
-   mreqn.imr_ifindex = if_nametoindex (iface);
-   if (!mreqn.imr_ifindex)
+   for (p = buf, end = buf + len; p < end; p = strchr (p, '\n') + 1)
    {
-      fprintf (stderr, "%s: \"%s\" invalid interface\n", __FUNCTION__, iface);
-      return 1;
+      unsigned char addr[16];
+      int i;
+
+      if (family == AF_INET)
+      {
+         /* "Idx\tDevice : ..." starts an interface, groups are indented */
+         if (*p != '\t')
+         {
+            if (*p >= '0' && *p <= '9')
+               idx = strtol (p, NULL, 10);
+            goto next;
+         }
+         if (idx != ifindex)
+            goto next;
+
+         while (*p == '\t')
+            p++;
+
+         /* The kernel prints the __be32 as a host endian integer */
+         {
+            uint32_t group = strtoul (p, NULL, 16);
+
+            memset (addr, 0, 10);
+            addr[10] = addr[11] = 0xff;
+            memcpy (&addr[12], &group, 4);
+         }
+      }
+      else
+      {
+         /* "idx dev group users flags timer", group as 32 hex digits */
+         if (strtol (p, &p, 10) != ifindex)
+            goto next;
+
+         while (*p == ' ')
+            p++;
+         while (*p && *p != ' ')
+            p++;
+         while (*p == ' ')
+            p++;
+
+         for (i = 0; i < 16; i++)
+         {
+            int hi = hexval (p[2 * i]), lo = hexval (p[2 * i + 1]);
+
+            if (hi < 0 || lo < 0)
+               break;
+            addr[i] = hi << 4 | lo;
+         }
+         if (i < 16)
+            goto next;
+      }
+
+      if (num == size)
+      {
+         size = size ? size * 2 : 1024;
+         tmp = realloc (keys, size * sizeof (struct gkey));
+         if (!tmp)
+         {
+            free (keys);
+            free (buf);
+            return -1;
+         }
+         keys = tmp;
+      }
+      memcpy (keys[num].addr, addr, 16);
+      keys[num].idx = -1;
+      num++;
+   next:
+      if (!strchr (p, '\n'))
+         break;
    }
-   DEBUG("Added iface %s, idx %d\n", iface, mreqn.imr_ifindex);
+   free (buf);
+
+   qsort (keys, num, sizeof (struct gkey), gkey_cmp);
+   *out = keys;
+
+   return num;
+}
+
+/* Joined by the kernel itself, 224.0.0.0/24 and ff01::/16, ff02::/16 */
+static int audit_local (const unsigned char *addr)
+{
+   static const unsigned char v4[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+   if (!memcmp (addr, v4, 12))
+      return addr[12] == 224 && addr[13] == 0 && addr[14] == 0;
+
+   return addr[0] == 0xff && (addr[1] & 0x0f) <= 2;
+}
+
+static void audit_show (const char *what, const unsigned char *addr, int *shown)
+{
+   static const unsigned char v4[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+   char buf[INET6_ADDRSTRLEN];
+
+   if (!verbose && (*shown)++ >= 10)
+      return;
+
+   if (!memcmp (addr, v4, 12))
+      inet_ntop (AF_INET, &addr[12], buf, sizeof (buf));
+   else
+      inet_ntop (AF_INET6, addr, buf, sizeof (buf));
+   printf ("  %s %s\n", what, buf);
+}
+
+static int audit (struct worker *w)
+{
+   struct gkey *want, *have = NULL;
+   int nwant, nhave, i, j, missing = 0, extra = 0, shown = 0;
+   uint64_t start, parsed, end;
 
-   if (inet_pton (AF_INET, group, &mreqn.imr_multiaddr) <= 0)
+   start = now_ns ();
+   nhave = audit_parse (w->family, w->pool.ifindex, &have);
+   if (nhave < 0)
    {
-      fprintf (stderr, "%s: \"%s\" invalid group address\n", __FUNCTION__, group);
+      fprintf (stderr, "Failed reading kernel memberships: %s\n", strerror (errno));
       return 1;
    }
-   DEBUG("GROUP %#x (%s)\n", mreqn.imr_multiaddr.s_addr, group);
+   parsed = now_ns ();
 
-   /* if (setsockopt (sock, SOL_IP, IP_ADD_MEMBERSHIP, &mreqn, sizeof (mreqn)) < 0) */
-   if (setsockopt (sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreqn, sizeof (mreqn)) < 0)
+   /* Source slices repeat every group, keep one of each */
+   want = gkey_build (w->groups, w->num);
+   if (!want)
    {
-      fprintf (stderr, "%s: IP_ADD_MEMBERSHIP: %s\n", __FUNCTION__, strerror (errno));
+      free (have);
       return 1;
    }
+   for (i = nwant = 0; i < w->num; i++)
+   {
+      if (!nwant || gkey_cmp (&want[nwant - 1], &want[i]))
+         want[nwant++] = want[i];
+   }
+
+   for (i = j = 0; i < nwant || j < nhave;)
+   {
+      int cmp = i == nwant ? 1 : j == nhave ? -1 : gkey_cmp (&want[i], &have[j]);
+
+      if (cmp < 0)
+      {
+         audit_show ("missing", want[i].addr, &shown);
+         missing++;
+         i++;
+      }
+      else if (cmp > 0)
+      {
+         if (!audit_local (have[j].addr))
+         {
+            audit_show ("extra  ", have[j].addr, &shown);
+            extra++;
+         }
+         j++;
+      }
+      else
+      {
+         i++;
+         j++;
+      }
+   }
+   end = now_ns ();
 
-   printf ("joined group %s on %s ...\n", group, iface);
+   printf ("Audit of %s: %d groups requested, %d in kernel, %d missing, %d extra, "
+           "in %.3f ms (%.3f ms reading and parsing)\n", w->iface, nwant, nhave, missing, extra,
+           (end - start) / 1e6, (parsed - start) / 1e6);
    fflush (stdout);
 
-   return 0;
+   free (want);
+   free (have);
+
+   return missing ? 1 : 0;
 }
 
 int main (int argc, char *argv[])
 {
-   int i, c, start_group = DEFAULT_GROUP, total = 0;
-   char iface[40], start[16], *group, *ptr;
+   int i, c, num = 0, family = AF_INET, total = 0;
+   int pattern = CHURN_NONE, burst = 10, measure = 0, port = DEFAULT_PORT;
+   int incremental = 0, hosts = 0, version = 3, nworkers = 0, check = 0;
+   uint32_t base = EMU_BASE;
+   double rate = 100.0, leave_rate = 0.0, hold = 1.0, duration = 0.0, timeout = 5.0;
+   struct worker *workers = NULL, *w;
+   struct sockaddr_storage first;
    struct in_addr start_in_addr;
+   struct group *groups;
+   char *ptr;
    struct option long_options[] = {
       /* {"verbose", 0, 0, 'V'}, */
       {"verbose", 0, 0, 'V'},
@@ -128,29 +2502,39 @@ int main (int argc, char *argv[])
       {"groups", 1, 0, 'n'},
       {"interface", 1, 0, 'i'},
       {"quiet", 0, 0, 'q'},
+      {"churn", 1, 0, 'c'},
+      {"rate", 1, 0, 'r'},
+      {"leave-rate", 1, 0, 'l'},
+      {"burst", 1, 0, 'b'},
+      {"hold", 1, 0, 'H'},
+      {"duration", 1, 0, 'd'},
+      {"measure", 0, 0, 'm'},
+      {"port", 1, 0, 'p'},
+      {"timeout", 1, 0, 't'},
+      {"source", 1, 0, 's'},
+      {"incremental", 0, 0, 'I'},
+      {"emulate", 1, 0, 'e'},
+      {"address", 1, 0, 'a'},
+      {"igmp", 1, 0, 'g'},
+      {"audit", 0, 0, 'A'},
       {"help", 0, 0, '?'},
       {0, 0, 0, 0}
     };
 
-   /* Default interface
-    * XXX - Should be the first, after lo, in the list at /proc/net/dev, or
-    * XXX - Iterate over /sys/class/net/.../link_mode */
-   strncpy (iface, "eth0", sizeof (iface));
+   addr_parse (DEFAULT_GROUP, &first);
 
-   while ((c = getopt_long (argc, argv, "f:n:i:qvVh?", long_options, NULL)) != EOF)
+   while ((c = getopt_long (argc, argv, "Aa:b:c:d:e:f:g:H:Il:mn:i:p:qr:s:t:vVh?", long_options, NULL)) != EOF)
    {
       switch (c)
       {
          case 'f':
-            start_in_addr.s_addr = 0;
-            if (inet_aton (optarg, &start_in_addr) == 0)
+            family = addr_parse (optarg, &first);
+            if (!family)
             {
-               perror ("Not a valid IP-address for first Multicast group.\n");
+               fprintf (stderr, "Not a valid IP-address for first Multicast group.\n");
                return 1;
             }
-            strncpy (start, optarg, sizeof(start));
-            start_group = ntohl (start_in_addr.s_addr);
-            DEBUG("MCSTART: %s, %#x (HOST:%#x)\n", start, start_in_addr.s_addr, start_group);
+            DEBUG("MCSTART: %s, family %d\n", optarg, family);
             break;
 
          case 'n':              /* number-of-groups */
@@ -164,14 +2548,98 @@ int main (int argc, char *argv[])
             break;
 
          case 'i':
-            strncpy (iface, optarg, sizeof(iface));
-            DEBUG("IFACE: %s\n", iface);
+            w = realloc (workers, (nworkers + 1) * sizeof (struct worker));
+            if (!w)
+            {
+               perror ("Failed allocating interface table");
+               return 1;
+            }
+            workers = w;
+            w = &workers[nworkers++];
+            memset (w, 0, sizeof (*w));
+            w->spec = strchr (optarg, '=');
+            if (w->spec)
+               *w->spec++ = 0;
+            snprintf (w->iface, sizeof (w->iface), "%s", optarg);
+            DEBUG("IFACE: %s\n", w->iface);
             break;
 
          case 'q':              /* --quiet */
             quiet = 1;
             break;
 
+         case 'c':              /* --churn */
+            if (!strcmp (optarg, "steady"))
+               pattern = CHURN_STEADY;
+            else if (!strcmp (optarg, "burst"))
+               pattern = CHURN_BURST;
+            else if (!strcmp (optarg, "random"))
+               pattern = CHURN_RANDOM;
+            else
+               return usage (argv[0]);
+            break;
+
+         case 'r':              /* --rate */
+            rate = atof (optarg);
+            break;
+
+         case 'l':              /* --leave-rate */
+            leave_rate = atof (optarg);
+            break;
+
+         case 'b':              /* --burst */
+            burst = atoi (optarg);
+            break;
+
+         case 'H':              /* --hold */
+            hold = atof (optarg);
+            break;
+
+         case 'd':              /* --duration */
+            duration = atof (optarg);
+            break;
+
+         case 'm':              /* --measure */
+            measure = 1;
+            break;
+
+         case 'p':              /* --port */
+            port = atoi (optarg);
+            break;
+
+         case 't':              /* --timeout */
+            timeout = atof (optarg);
+            break;
+
+         case 's':              /* --source */
+            if (source_parse (optarg))
+               return 1;
+            break;
+
+         case 'I':              /* --incremental */
+            incremental = 1;
+            break;
+
+         case 'A':              /* --audit */
+            check = 1;
+            break;
+
+         case 'e':              /* --emulate */
+            hosts = atoi (optarg);
+            break;
+
+         case 'a':              /* --address */
+            if (!inet_aton (optarg, &start_in_addr))
+               return usage (argv[0]);
+            base = ntohl (start_in_addr.s_addr);
+            break;
+
+         case 'g':              /* --igmp */
+            version = atoi (optarg);
+            if (version != 2 && version != 3)
+               return usage (argv[0]);
+            break;
+
          case 'v':              /* --version */
             printf ("%s\n", program_version);
             return 0;
@@ -193,46 +2661,183 @@ int main (int argc, char *argv[])
       return (usage(argv[0]));
    }
 
+   /* Resolve all groups once, before we start joining */
+   groups = calloc (total ? total : argc - optind + 1, sizeof (struct group));
+   if (!groups)
+   {
+      perror ("Failed allocating group table");
+      return 1;
+   }
+
    if (!total)
    {
       for (i = optind; i < argc; i++)
       {
-         start_in_addr.s_addr = 0;
-         if (inet_aton (argv[i], &start_in_addr) == 0)
+         struct sockaddr_storage ss;
+         int af;
+
+         af = addr_parse (argv[i], &ss);
+         if (!af)
          {
-            fprintf (stderr, "Group %s is not a valid IPv4 address: %s\n",
-                     argv[i], strerror (errno));
+            fprintf (stderr, "Group %s is not a valid IPv4 or IPv6 address\n", argv[i]);
             return 1;
          }
-         start_group = ntohl (start_in_addr.s_addr);
-         start_in_addr.s_addr = htonl (start_group);
-         group = inet_ntoa (start_in_addr);
-         DEBUG("Trying to join %#x (%s)\n", start_in_addr.s_addr, group);
-         if (join_group (iface, group))
+         if (num && af != family)
          {
-            /* Bailing out. */
-            DEBUG("Bailing out...\n");
+            fprintf (stderr, "Cannot mix IPv4 and IPv6 groups\n");
             return 1;
          }
+         family = af;
+         group_set (&groups[num++], &ss, family, 0);
       }
    }
    else
    {
+      /* Ranges count up in the low 32 bits, e.g. ff3e::8000:1 and up */
       for (i = 0; i < total; i++)
+         group_set (&groups[num++], &first, family, i);
+   }
+
+   /* Default interface
+    * XXX - Should be the first, after lo, in the list at /proc/net/dev, or
+    * XXX - Iterate over /sys/class/net/.../link_mode */
+   if (!nworkers)
+   {
+      workers = calloc (1, sizeof (struct worker));
+      if (!workers)
+      {
+         perror ("Failed allocating interface table");
+         return 1;
+      }
+      snprintf (workers[0].iface, sizeof (workers[0].iface), "eth0");
+      nworkers = 1;
+   }
+   if (nworkers > 1 && (hosts || measure || pattern != CHURN_NONE))
+   {
+      fprintf (stderr, "Churn, measure and emulate modes run on one interface only\n");
+      return 1;
+   }
+
+   /* Each worker gets its own copy of the common set, or its own set */
+   for (i = 0; i < nworkers; i++)
+   {
+      w = &workers[i];
+      if (w->spec)
+      {
+         if (worker_groups (w))
+            return 1;
+      }
+      else
+      {
+         if (!num)
+         {
+            fprintf (stderr, "No groups to join on %s\n", w->iface);
+            return 1;
+         }
+         w->groups = malloc (num * sizeof (struct group));
+         if (!w->groups)
+         {
+            perror ("Failed allocating group table");
+            return 1;
+         }
+         memcpy (w->groups, groups, num * sizeof (struct group));
+         w->num = num;
+         w->family = family;
+      }
+
+      if (nsources && source_family != w->family)
+      {
+         fprintf (stderr, "Sources and groups must be of the same address family\n");
+         return 1;
+      }
+      if (w->family == AF_INET6 && (measure || hosts))
+      {
+         fprintf (stderr, "Measure and emulate modes are IPv4 only\n");
+         return 1;
+      }
+
+      if (pool_init (&w->pool, w->family, w->iface, w->num))
+         return 1;
+
+      if (nsources && !hosts)
       {
-         start_in_addr.s_addr = htonl (start_group + i);
-         group = inet_ntoa (start_in_addr);
-         DEBUG("Trying to join %#x (%s)\n", start_in_addr.s_addr, group);
-         if (join_group (iface, group))
+         if (nsources > w->pool.msf && (measure || pattern != CHURN_NONE))
          {
-            /* Bailing out. */
-            DEBUG("Bailing out...\n");
+            fprintf (stderr, "More than %s (%d) sources only supported when joining once\n",
+                     w->family == AF_INET ? "igmp_max_msf" : "mld_max_msf", w->pool.msf);
             return 1;
          }
+
+         w->pool.incremental = incremental;
+         w->num = source_expand (&w->groups, w->num, w->pool.msf);
+         if (w->num < 0)
+            return 1;
+         /* Each slice starts on fresh sockets */
+         raise_fd_limit ((nsources + w->pool.msf - 1) / w->pool.msf);
+      }
+   }
+   free (groups);
+
+   signal (SIGINT, sigcb);
+   signal (SIGTERM, sigcb);
+
+   w = &workers[0];
+   if (hosts > 0)
+   {
+      if (version == 2 && nsources)
+      {
+         fprintf (stderr, "IGMPv2 cannot carry sources, use --igmp=3\n");
+         return 1;
+      }
+
+      srand48 (time (NULL));
+      if (emu_run (&w->pool, w->iface, w->groups, w->num, hosts, base, version, rate, duration))
+         return 1;
+   }
+   else if (measure)
+   {
+      w->pool.port = port;
+      w->pool.epfd = epoll_create1 (0);
+      if (w->pool.epfd < 0)
+      {
+         perror ("Failed creating epoll instance");
+         return 1;
       }
+
+      if (measure_run (&w->pool, w->iface, w->groups, w->num, timeout))
+         return 1;
+   }
+   else if (pattern != CHURN_NONE)
+   {
+      if (rate <= 0 || burst < 1 || hold < 0)
+         return usage (argv[0]);
+      if (leave_rate <= 0)
+         leave_rate = rate;
+
+      srand48 (time (NULL));
+      if (churn_run (&w->pool, w->groups, w->num, pattern, rate, leave_rate, burst, hold, duration))
+         return 1;
    }
+   else
+   {
+      if (join_all (workers, nworkers))
+         return 1;
+
+      for (i = 0; check && i < nworkers; i++)
+         audit (&workers[i]);
 
-   pause ();                    /* Awaiting signal before exiting. */
+      while (running)
+         pause ();              /* Awaiting signal before exiting. */
+   }
+
+   for (i = 0; i < nworkers; i++)
+   {
+      w = &workers[i];
+      leave_groups (&w->pool, w->iface, w->groups, w->num);
+      pool_exit (&w->pool);
+      free (w->groups);
+   }
+   free (workers);
 
    return 0;
 }
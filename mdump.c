@@ -27,28 +27,199 @@
  */
 
 #define MULTICAST
+#define _GNU_SOURCE		/* O_DIRECT */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
 #define DEFAULT_GROUP   0xe0027fff
 #define DEFAULT_PORT    9876
+#define DEFAULT_OUTAGE  100	/* msec */
 #define MAXPDU          4096
+#define MAXEVENTS       64
+#define LATMAX          10000	/* usec, latency histogram range */
+#define BUSY_POLL_USEC  50
+#define CATCHALL        (1ULL << 32)	/* epoll tag, low bits is the fd */
 #define WIDTH           16
 
+#define CAPBLOCK        (4 << 20)	/* Capture block, multiple of CAPALIGN */
+#define CAPALIGN        4096	/* O_DIRECT buffer/offset/size alignment */
+#define CAPBUFS         2
+
+/* Epoll busy poll parameters, Linux 6.9, see <linux/eventpoll.h> */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t  prefer_busy_poll;
+    uint8_t  __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* pcap savefile format, see pcap-savefile(5) */
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define LINKTYPE_NULL   0
+#define LINKTYPE_EN10MB 1
+#define LINKTYPE_RAW    101
+#define LINKTYPE_SLL    113
+#define LINKTYPE_SLL2   276
+
+struct pcap_hdr {
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec {
+    uint32_t sec, usec;		/* usec is nsec with PCAP_MAGIC_NSEC */
+    uint32_t caplen, len;
+};
+
+/* What we know about a packet, besides its payload */
+struct meta {
+    struct timeval tv;		/* Kernel or capture timestamp */
+    struct sockaddr_in from;
+    struct in_addr dst;
+    u_short dport;
+    int ifindex;
+};
+
+/*
+ * Capture writer.  Packets are appended as pcap records to large, page
+ * aligned blocks which are written with O_DIRECT, so long captures do
+ * not fill the page cache.  Writes are submitted to io_uring, or handed
+ * to a pwrite() thread where io_uring is unavailable, so while one block
+ * is on its way to disk the receive path fills the other.  It only has
+ * to wait, a stall, if the disk falls a whole block behind.
+ */
+struct capture {
+    int fd;
+    int direct;			/* Opened with O_DIRECT */
+    char *block[CAPBUFS];
+    struct iovec iov[CAPBUFS];
+    int busy[CAPBUFS];		/* Block in flight, protected by lock */
+    int cur;			/* Block being filled */
+    size_t fill;
+    off_t offset;		/* File offset of current block */
+    off_t offset_of[CAPBUFS];	/* File offset of each block in flight */
+    int error;
+
+#ifdef HAVE_IO_URING
+    int ring;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+
+    unsigned long pkts;
+    uint64_t bytes;
+    unsigned long stalls;
+    int64_t stall_usec, stall_max;
+    struct timespec start;
+};
+
+#define USEC(tv)        ((int64_t)(tv).tv_sec * 1000000 + (tv).tv_usec)
+
 u_long groupaddr = DEFAULT_GROUP;
 u_short groupport = DEFAULT_PORT;
 
-void dump(char *buf, int buflen)
+/*
+ * Per-group receive state.  The table is allocated once at startup,
+ * the receive path never allocates.  Sequence numbers are the 32-bit
+ * network order counter mcgen stamps first in each payload with -S.
+ */
+struct group {
+    struct in_addr addr;
+    int sock;			/* Own socket, or -1 in catch-all mode */
+    int ifindex;		/* Ingress interface, from IP_PKTINFO */
+
+    int seen;			/* Any packet received yet? */
+    int dark;			/* Currently reported as dark */
+    uint32_t seq;		/* Last sequence number */
+    struct timeval last;	/* Last arrival, kernel timestamp */
+
+    unsigned long rcvd;
+    unsigned long lost;
+    unsigned long outages;
+    int64_t dark_usec;		/* Accumulated outage time */
+    int64_t max_usec;		/* Longest single outage */
+};
+
+struct group *groups;
+int num_groups = 1;
+unsigned long stray;		/* Catch-all packets for unknown groups */
+int64_t threshold = DEFAULT_OUTAGE * 1000;
+volatile sig_atomic_t running = 1;
+int failover;			/* Stats stage instead of dump stage */
+int capturing;			/* Capture stage instead of dump stage */
+struct capture cap;
+uint32_t *sockdrops;		/* Last SO_RXQ_OVFL count, per socket */
+int maxfd;
+int quiet;			/* Neither, only receive/decode */
+
+int busy_poll;			/* Spin instead of sleeping in epoll_wait() */
+int64_t spin_budget;		/* usec to spin before blocking, 0: forever */
+int latency;			/* Measure kernel to user delivery latency */
+unsigned long lathist[LATMAX + 1];	/* One bucket per usec, last is overflow */
+
+int usage(char *name)
+{
+    printf("usage: %s [-cflq] [-b usec] [-n num] [-o msec] [-r file [-R]] [-w file]\n"
+	   "         [group [port [interface]]]\n"
+	   "\n"
+	   "  -b usec  Spin in userspace on epoll_wait() for usec before blocking\n"
+	   "           (0: forever), implies -l, and ask for epoll busy polling\n"
+	   "  -c       Catch-all mode, few sockets on INADDR_ANY:port, demux on IP_PKTINFO\n"
+	   "  -f       Failover mode, track per-group outages instead of dumping\n"
+	   "  -l       Report kernel to user receive latency distribution on exit\n"
+	   "  -n num   Number of consecutive groups to receive, starting at group\n"
+	   "  -o msec  Report gaps longer than msec as outages, default %d\n"
+	   "  -q       Quiet, skip dump, useful for benchmarking with -r\n"
+	   "  -r file  Replay UDP payloads from a pcap file instead of the network\n"
+	   "  -R       Replay at recorded pace, default is as fast as possible\n"
+	   "  -w file  Capture to pcap file, using O_DIRECT and io_uring when available\n",
+	   name, DEFAULT_OUTAGE);
+
+    return 1;
+}
+
+void dump(const char *buf, int buflen)
 {
     int i, j;
     unsigned char c;
@@ -76,32 +247,254 @@ void dump(char *buf, int buflen)
     printf("\t%s\n", text);
 }
 
-int main(int argc, char *argv[])
+char *timestamp(const struct timeval *tv)
 {
-    int ret;
-    int sock, length;
-    char buf[MAXPDU];
-    struct sockaddr_in name;
-    struct ip_mreq imr;
-    char *interface = NULL;
-    fd_set fds;
+    static char buf[32];
+    char hms[16];
+    time_t t = tv->tv_sec;
 
-    if (argc > 4) {
-	printf("usage: %s [group [port [interface]]]\n", argv[0]);
-	exit(1);
+    strftime(hms, sizeof(hms), "%H:%M:%S", localtime(&t));
+    snprintf(buf, sizeof(buf), "%s.%06ld", hms, (long)tv->tv_usec);
+
+    return buf;
+}
+
+/*
+ * Called for every packet in failover mode.  A gap since the previous
+ * arrival longer than the threshold is an outage, the sequence number
+ * tells how many packets were lost while the group was dark.
+ */
+void track(struct group *g, const char *buf, int buflen, const struct timeval *tv)
+{
+    uint32_t seq = 0, gap = 0;
+    int64_t dark;
+
+    if (buflen >= (int)sizeof(seq)) {
+	memcpy(&seq, buf, sizeof(seq));
+	seq = ntohl(seq);
     }
 
-    if (argc > 1) {
-	groupaddr = inet_addr(argv[1]);
+    g->rcvd++;
+    if (!g->seen) {
+	g->seen = 1;
+	g->seq  = seq;
+	g->last = *tv;
+	return;
     }
 
-    if (argc > 2) {
-	groupport = (u_short)atoi(argv[2]);
+    if (seq - g->seq - 1 < 0x80000000)
+	gap = seq - g->seq - 1;
+    g->lost += gap;
+
+    dark = USEC(*tv) - USEC(g->last);
+    if (dark > threshold) {
+	g->outages++;
+	g->dark_usec += dark;
+	if (dark > g->max_usec)
+	    g->max_usec = dark;
+
+	printf("%-15s outage at %s, ", inet_ntoa(g->addr), timestamp(&g->last));
+	printf("%lld.%06lld sec, %u lost, recovered at %s\n",
+	       (long long)(dark / 1000000), (long long)(dark % 1000000),
+	       gap, timestamp(tv));
+	fflush(stdout);
     }
 
-    if (argc == 4) {
-	interface = argv[3];
-    }    
+    g->dark = 0;
+    g->seq  = seq;
+    g->last = *tv;
+}
+
+/*
+ * Runs when poll() times out or periodically, flags groups that have
+ * gone dark so an ongoing outage is visible before traffic recovers.
+ */
+void scan(const struct timeval *now)
+{
+    int i;
+
+    for (i = 0; i < num_groups; i++) {
+	struct group *g = &groups[i];
+
+	if (!g->seen || g->dark)
+	    continue;
+	if (USEC(*now) - USEC(g->last) > threshold) {
+	    g->dark = 1;
+	    printf("%-15s dark since %s\n", inet_ntoa(g->addr), timestamp(&g->last));
+	    fflush(stdout);
+	}
+    }
+}
+
+/*
+ * An outage still going on at exit counts up to now, which for a
+ * replay (now NULL) is the last packet in the recording.  Those rows
+ * are marked ongoing.
+ */
+void summary(const struct timeval *now)
+{
+    unsigned long outages = 0, lost = 0, rcvd = 0;
+    int64_t worst = 0, end = 0, dark;
+    int i, ongoing;
+
+    if (now)
+	end = USEC(*now);
+    else
+	for (i = 0; i < num_groups; i++)
+	    if (groups[i].seen && USEC(groups[i].last) > end)
+		end = USEC(groups[i].last);
+
+    printf("\n%-15s %-8s %10s %8s %7s %14s %14s\n", "Group", "Iface",
+	   "Received", "Lost", "Outages", "Dark (ms)", "Longest (ms)");
+    for (i = 0; i < num_groups; i++) {
+	struct group *g = &groups[i];
+	char ifname[IF_NAMESIZE] = "-";
+
+	dark = end - USEC(g->last);
+	ongoing = g->seen && (g->dark || dark > threshold);
+	if (ongoing) {
+	    g->outages++;
+	    g->dark_usec += dark;
+	    if (dark > g->max_usec)
+		g->max_usec = dark;
+	}
+	if (g->ifindex)
+	    if_indextoname(g->ifindex, ifname);
+	printf("%-15s %-8s %10lu %8lu %7lu %14.3f %14.3f%s\n", inet_ntoa(g->addr),
+	       ifname, g->rcvd, g->lost, g->outages,
+	       g->dark_usec / 1000.0, g->max_usec / 1000.0, ongoing ? "  ongoing" : "");
+	rcvd    += g->rcvd;
+	lost    += g->lost;
+	outages += g->outages;
+	if (g->max_usec > worst)
+	    worst = g->max_usec;
+    }
+    printf("%-15s %-8s %10lu %8lu %7lu %14s %14.3f\n", "Total", "",
+	   rcvd, lost, outages, "", worst / 1000.0);
+    if (stray)
+	printf("%lu packets to groups outside of range ignored\n", stray);
+}
+
+/*
+ * Receive latency is the time from the kernel timestamping a packet
+ * until mdump has it in user space, i.e. the host-side wakeup cost.
+ * Compare runs with -l and -b to see what busy polling buys.
+ */
+void distribution(void)
+{
+    const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned long total = 0, sum = 0;
+    size_t i, j;
+    int max = 0;
+
+    for (i = 0; i <= LATMAX; i++) {
+	total += lathist[i];
+	if (lathist[i])
+	    max = i;
+    }
+    if (!total)
+	return;
+
+    if (busy_poll)
+	printf("\nReceive latency, epoll busy poll %d usec, spin budget %lld usec:\n",
+	       BUSY_POLL_USEC, (long long)spin_budget);
+    else
+	printf("\nReceive latency, blocking epoll_wait():\n");
+
+    for (i = 0, j = 0; j < sizeof(pct) / sizeof(pct[0]); j++) {
+	while (i < LATMAX && (sum + lathist[i]) * 100.0 < pct[j] * total)
+	    sum += lathist[i++];
+	printf("  p%-5g %s%zu usec\n", pct[j], i == LATMAX ? ">" : "", i);
+    }
+    printf("  max    %s%d usec (%lu packets)\n", max == LATMAX ? ">" : "", max, total);
+}
+
+/*
+ * The -b spin, in userspace: poll the sockets with a zero timeout for
+ * up to spin_budget usec, then fall back to a regular, blocking,
+ * epoll_wait().
+ */
+int spin(int epfd, struct epoll_event *events, int timeout)
+{
+    struct timeval start, now;
+    int num;
+
+    gettimeofday(&start, NULL);
+    while (running) {
+	num = epoll_wait(epfd, events, MAXEVENTS, 0);
+	if (num)
+	    return num;
+
+	if (spin_budget) {
+	    gettimeofday(&now, NULL);
+	    if (USEC(now) - USEC(start) >= spin_budget)
+		break;
+	}
+    }
+
+    return epoll_wait(epfd, events, MAXEVENTS, timeout);
+}
+
+void sigcb(int signo)
+{
+    (void)signo;
+    running = 0;
+}
+
+/*
+ * Read one datagram along with its kernel receive timestamp, sender,
+ * original destination address and ingress interface.  Falls back to
+ * gettimeofday() if the kernel did not supply SCM_TIMESTAMP.
+ */
+int receive(int sock, char *buf, size_t len, struct meta *m)
+{
+    char cbuf[CMSG_SPACE(sizeof(struct timeval)) +
+	      CMSG_SPACE(sizeof(struct in_pktinfo)) +
+	      CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int length, stamped = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &m->from;
+    msg.msg_namelen = sizeof(m->from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    length = recvmsg(sock, &msg, 0);
+    if (length < 0)
+	return length;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+	    memcpy(&m->tv, CMSG_DATA(cmsg), sizeof(m->tv));
+	    stamped = 1;
+	}
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL &&
+	    sock < maxfd)
+	    memcpy(&sockdrops[sock], CMSG_DATA(cmsg), sizeof(uint32_t));
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+	    struct in_pktinfo pi;
+
+	    memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+	    m->dst = pi.ipi_addr;
+	    m->ifindex = pi.ipi_ifindex;
+	}
+    }
+    if (!stamped)
+	gettimeofday(&m->tv, NULL);
+    m->dport = groupport;
+
+    return length;
+}
+
+int open_socket(struct in_addr addr)
+{
+    int sock, ret, on = 1;
+    struct sockaddr_in name;
 
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if(sock < 0) {
@@ -109,51 +502,1001 @@ int main(int argc, char *argv[])
 	exit(1);
     }
 
-    imr.imr_multiaddr.s_addr = groupaddr;
-    imr.imr_multiaddr.s_addr = htonl(imr.imr_multiaddr.s_addr);
-    if (interface) {
-	imr.imr_interface.s_addr = inet_addr(interface);
-    } else {
-	imr.imr_interface.s_addr = htonl(INADDR_ANY);
+    ret = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+    if (ret < 0)
+	perror("setsockopt - SO_TIMESTAMP");
+    ret = setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+    if (ret < 0)
+	perror("setsockopt - IP_PKTINFO");
+    if (capturing) {
+	int size = CAPBLOCK;
+
+	/* Absorb bursts, above net.core.rmem_max needs CAP_NET_ADMIN */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+	    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
     }
-    imr.imr_interface.s_addr = htonl(imr.imr_interface.s_addr);
 
-    ret = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(struct ip_mreq));
-    if (ret < 0) {
-	perror("setsockopt - IP_ADD_MEMBERSHIP");
+    if (addr.s_addr == htonl(INADDR_ANY)) {
+	int off = 0;
+
+	/* Several catch-all sockets share the port */
+	ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (ret < 0)
+	    perror("setsockopt - SO_REUSEADDR");
+#ifdef IP_MULTICAST_ALL
+	/* Only deliver the groups joined on this socket, no duplicates */
+	ret = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+	if (ret < 0)
+	    perror("setsockopt - IP_MULTICAST_ALL");
+#endif
+    }
+
+    name.sin_family = AF_INET;
+    name.sin_addr = addr;
+    name.sin_port = htons(groupport);
+    ret = bind(sock, (struct sockaddr *)&name, sizeof(name));
+    if (ret) {
+	perror("bind");
 	exit(1);
     }
 
+    return sock;
+}
+
+int join(int sock, struct in_addr group, struct in_addr ifaddr)
+{
+    struct ip_mreq imr;
+
+    imr.imr_multiaddr = group;
+    imr.imr_interface = ifaddr;
+
+    return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(struct ip_mreq));
+}
+
+int open_group(struct in_addr group, struct in_addr ifaddr)
+{
+    int sock;
+    struct in_addr addr;
+
     /*
      *	Use INADDR_ANY if your multicast port doesn't allow
      *	binding to a multicast address.
      *
      */
-
-    name.sin_family = AF_INET;
 #ifndef CANT_MCAST_BIND
-    name.sin_addr.s_addr = htonl(groupaddr);
+    addr = group;
 #else
-    name.sin_addr.s_addr = INADDR_ANY;
+    addr.s_addr = INADDR_ANY;
 #endif
-    name.sin_port = htons(groupport);
-    ret = bind(sock, (struct sockaddr *)&name, sizeof(name));
-    if (ret) {
-	perror("bind");
+    sock = open_socket(addr);
+    if (join(sock, group, ifaddr) < 0) {
+	perror("setsockopt - IP_ADD_MEMBERSHIP");
 	exit(1);
     }
 
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    while (select(sock + 1, &fds, 0, 0, 0) > 0) {
-	length = recv(sock, (char *) buf, sizeof(buf), 0);
-	if (length < 0) {
-	    perror("recv");
-	    exit(1);
+    return sock;
+}
+
+/*
+ * Join all groups on as few INADDR_ANY sockets as possible.  The kernel
+ * caps memberships per socket (net.ipv4.igmp_max_memberships), so when
+ * a join fails with ENOBUFS we move on to a fresh socket.
+ */
+void open_catchall(int epfd, struct in_addr ifaddr)
+{
+    struct epoll_event ev;
+    struct in_addr any;
+    int i, sock = -1, joined = 0, nsocks = 0;
+
+    any.s_addr = htonl(INADDR_ANY);
+    for (i = 0; i < num_groups; i++) {
+	groups[i].sock = -1;
+	while (sock < 0 || join(sock, groups[i].addr, ifaddr) < 0) {
+	    /* Only a full socket is a reason to open another one */
+	    if (sock >= 0 && (errno != ENOBUFS || !joined)) {
+		perror("setsockopt - IP_ADD_MEMBERSHIP");
+		exit(1);
+	    }
+
+	    sock = open_socket(any);
+	    joined = 0;
+	    ev.events = EPOLLIN;
+	    ev.data.u64 = CATCHALL | sock;
+	    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)) {
+		perror("epoll_ctl");
+		exit(1);
+	    }
+	    nsocks++;
+	}
+	joined++;
+    }
+
+    printf("Joined %d groups on %d sockets\n", num_groups, nsocks);
+}
+
+/* Make room for one socket per group, up to the hard limit. */
+void fdlimit(int num)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+	return;
+    if (rl.rlim_cur >= (rlim_t)num + 16)
+	return;
+
+    rl.rlim_cur = (rlim_t)num + 16;
+    if (rl.rlim_cur > rl.rlim_max)
+	rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl))
+	perror("setrlimit");
+}
+
+#ifdef HAVE_IO_URING
+static int cap_uring_setup(void)
+{
+    struct io_uring_params p;
+    size_t sq_sz, cq_sz;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    cap.ring = syscall(__NR_io_uring_setup, CAPBUFS, &p);
+    if (cap.ring < 0)
+	return -1;
+
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (cq_sz > sq_sz)
+	    sq_sz = cq_sz;
+	cq_sz = sq_sz;
+    }
+
+    sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      cap.ring, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+	goto fail;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+	cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  cap.ring, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+	    goto fail;
+    }
+    cap.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    cap.ring, IORING_OFF_SQES);
+    if (cap.sqes == MAP_FAILED)
+	goto fail;
+
+    cap.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    cap.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    cap.sq_array = (unsigned *)(sq + p.sq_off.array);
+    cap.cq_head  = (unsigned *)(cq + p.cq_off.head);
+    cap.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    cap.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    cap.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+fail:
+    close(cap.ring);
+    cap.ring = -1;
+    return -1;
+}
+
+/* Collect completed writes, optionally waiting for at least one */
+static void cap_uring_reap(int wait)
+{
+    unsigned head;
+
+    if (wait && syscall(__NR_io_uring_enter, cap.ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+	if (errno != EINTR)
+	    cap.error = errno;
+	return;
+    }
+
+    head = *cap.cq_head;
+    while (head != __atomic_load_n(cap.cq_tail, __ATOMIC_ACQUIRE)) {
+	struct io_uring_cqe *cqe = &cap.cqes[head & *cap.cq_mask];
+	int idx = cqe->user_data;
+
+	if (cqe->res < 0)
+	    cap.error = -cqe->res;
+	else if ((size_t)cqe->res != cap.iov[idx].iov_len)
+	    cap.error = EIO;
+	cap.busy[idx] = 0;
+	head++;
+    }
+    __atomic_store_n(cap.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+static ssize_t pwrite_all(int fd, const char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+	ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	done += n;
+    }
+
+    return done;
+}
+
+/* Fallback writer when io_uring is not available */
+static void *cap_thread(void *arg)
+{
+    int i;
+
+    (void)arg;
+    pthread_mutex_lock(&cap.lock);
+    while (1) {
+	for (i = 0; i < CAPBUFS; i++) {
+	    if (cap.busy[i])
+		break;
+	}
+	if (i == CAPBUFS) {
+	    if (cap.quit)
+		break;
+	    pthread_cond_wait(&cap.cond, &cap.lock);
+	    continue;
+	}
+
+	pthread_mutex_unlock(&cap.lock);
+	if (pwrite_all(cap.fd, cap.iov[i].iov_base, cap.iov[i].iov_len,
+		       cap.offset_of[i]) < 0)
+	    cap.error = errno;
+	pthread_mutex_lock(&cap.lock);
+	cap.busy[i] = 0;
+	pthread_cond_broadcast(&cap.cond);
+    }
+    pthread_mutex_unlock(&cap.lock);
+
+    return NULL;
+}
+
+static void cap_submit(int idx, size_t len)
+{
+    cap.iov[idx].iov_base = cap.block[idx];
+    cap.iov[idx].iov_len  = len;
+    cap.offset_of[idx]    = cap.offset;
+
+#ifdef HAVE_IO_URING
+    if (cap.ring >= 0) {
+	unsigned tail = *cap.sq_tail, i = tail & *cap.sq_mask;
+	struct io_uring_sqe *sqe = &cap.sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = IORING_OP_WRITEV;
+	sqe->fd        = cap.fd;
+	sqe->addr      = (unsigned long)&cap.iov[idx];
+	sqe->len       = 1;
+	sqe->off       = cap.offset;
+	sqe->user_data = idx;
+	cap.sq_array[i] = i;
+	cap.busy[idx] = 1;
+	__atomic_store_n(cap.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, cap.ring, 1, 0, 0, NULL, 0) < 0)
+	    cap.error = errno;
+	cap_uring_reap(0);
+	return;
+    }
+#endif
+    pthread_mutex_lock(&cap.lock);
+    cap.busy[idx] = 1;
+    pthread_cond_broadcast(&cap.cond);
+    pthread_mutex_unlock(&cap.lock);
+}
+
+static void cap_wait(int idx)
+{
+#ifdef HAVE_IO_URING
+    if (cap.ring >= 0) {
+	while (cap.busy[idx] && !cap.error)
+	    cap_uring_reap(1);
+	return;
+    }
+#endif
+    pthread_mutex_lock(&cap.lock);
+    while (cap.busy[idx])
+	pthread_cond_wait(&cap.cond, &cap.lock);
+    pthread_mutex_unlock(&cap.lock);
+}
+
+static int cap_busy(int idx)
+{
+    int busy;
+
+#ifdef HAVE_IO_URING
+    if (cap.ring >= 0) {
+	cap_uring_reap(0);
+	return cap.busy[idx];
+    }
+#endif
+    pthread_mutex_lock(&cap.lock);
+    busy = cap.busy[idx];
+    pthread_mutex_unlock(&cap.lock);
+
+    return busy;
+}
+
+/* Current block is full, send it off and move on to the next one */
+static void cap_flush(void)
+{
+    cap_submit(cap.cur, CAPBLOCK);
+    cap.offset += CAPBLOCK;
+    cap.cur = (cap.cur + 1) % CAPBUFS;
+    cap.fill = 0;
+
+    if (cap_busy(cap.cur)) {
+	struct timespec t0, t1;
+	int64_t usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	cap_wait(cap.cur);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	usec = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+	cap.stalls++;
+	cap.stall_usec += usec;
+	if (usec > cap.stall_max)
+	    cap.stall_max = usec;
+    }
+}
+
+static void cap_write(const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len) {
+	size_t room = CAPBLOCK - cap.fill, n = len < room ? len : room;
+
+	memcpy(cap.block[cap.cur] + cap.fill, p, n);
+	cap.fill += n;
+	cap.bytes += n;
+	p   += n;
+	len -= n;
+	if (cap.fill == CAPBLOCK)
+	    cap_flush();
+    }
+}
+
+int cap_open(const char *file)
+{
+    struct pcap_hdr hdr;
+    int i;
+
+    cap.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    cap.direct = 1;
+    if (cap.fd < 0 && errno == EINVAL) {
+	/* E.g. tmpfs, fall back to buffered writes */
+	cap.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	cap.direct = 0;
+    }
+    if (cap.fd < 0) {
+	perror(file);
+	return -1;
+    }
+
+    for (i = 0; i < CAPBUFS; i++) {
+	if (posix_memalign((void **)&cap.block[i], CAPALIGN, CAPBLOCK)) {
+	    perror("posix_memalign");
+	    return -1;
+	}
+	memset(cap.block[i], 0, CAPBLOCK);
+    }
+
+#ifdef HAVE_IO_URING
+    if (cap_uring_setup())
+#endif
+    {
+	pthread_mutex_init(&cap.lock, NULL);
+	pthread_cond_init(&cap.cond, NULL);
+	if (pthread_create(&cap.thread, NULL, cap_thread, NULL)) {
+	    perror("pthread_create");
+	    return -1;
 	}
+    }
+
+    hdr.magic    = PCAP_MAGIC;
+    hdr.major    = 2;
+    hdr.minor    = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs  = 0;
+    hdr.snaplen  = 65535;
+    hdr.linktype = LINKTYPE_RAW;
+    cap_write(&hdr, sizeof(hdr));
+    clock_gettime(CLOCK_MONOTONIC, &cap.start);
+
+    return 0;
+}
+
+/*
+ * Save one packet.  The socket API only gives us the UDP payload, so
+ * the IPv4 and UDP headers are reconstructed for a LINKTYPE_RAW record.
+ * The IP checksum is filled in, the UDP checksum is left out (zero).
+ */
+void cap_packet(const struct meta *m, const char *buf, int len)
+{
+    struct {
+	struct pcap_rec rec;
+	u_char ip[20];
+	u_char udp[8];
+    } __attribute__((packed)) h;
+    uint32_t sum = 0;
+    int i;
+
+    if (cap.error)
+	return;
+
+    memset(&h, 0, sizeof(h));
+    h.rec.sec    = m->tv.tv_sec;
+    h.rec.usec   = m->tv.tv_usec;
+    h.rec.caplen = h.rec.len = sizeof(h.ip) + sizeof(h.udp) + len;
+
+    h.ip[0] = 0x45;
+    h.ip[2] = h.rec.len >> 8;
+    h.ip[3] = h.rec.len & 0xff;
+    h.ip[8] = 1;
+    h.ip[9] = IPPROTO_UDP;
+    memcpy(&h.ip[12], &m->from.sin_addr, 4);
+    memcpy(&h.ip[16], &m->dst, 4);
+    for (i = 0; i < 20; i += 2)
+	sum += h.ip[i] << 8 | h.ip[i + 1];
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = ~(sum + (sum >> 16)) & 0xffff;
+    h.ip[10] = sum >> 8;
+    h.ip[11] = sum & 0xff;
+
+    memcpy(&h.udp[0], &m->from.sin_port, 2);
+    h.udp[2] = m->dport >> 8;
+    h.udp[3] = m->dport & 0xff;
+    h.udp[4] = (len + 8) >> 8;
+    h.udp[5] = (len + 8) & 0xff;
+
+    cap_write(&h, sizeof(h));
+    cap_write(buf, len);
+    cap.pkts++;
+}
+
+/*
+ * Flush the last, partial, block.  O_DIRECT only writes whole aligned
+ * blocks, so it is padded and the file truncated to the real size.
+ */
+void cap_close(void)
+{
+    unsigned long drops = 0;
+    struct timespec now;
+    double elapsed;
+    int i;
+
+    for (i = 0; i < CAPBUFS; i++)
+	cap_wait(i);
+    if (cap.fill) {
+	size_t len = (cap.fill + CAPALIGN - 1) & ~(size_t)(CAPALIGN - 1);
+
+	memset(cap.block[cap.cur] + cap.fill, 0, len - cap.fill);
+	cap_submit(cap.cur, len);
+	cap_wait(cap.cur);
+    }
+    if (ftruncate(cap.fd, cap.offset + cap.fill))
+	perror("ftruncate");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+#ifdef HAVE_IO_URING
+    if (cap.ring >= 0) {
+	close(cap.ring);
+    } else
+#endif
+    {
+	pthread_mutex_lock(&cap.lock);
+	cap.quit = 1;
+	pthread_cond_broadcast(&cap.cond);
+	pthread_mutex_unlock(&cap.lock);
+	pthread_join(cap.thread, NULL);
+    }
+    close(cap.fd);
+    for (i = 0; i < CAPBUFS; i++)
+	free(cap.block[i]);
+
+    for (i = 0; i < maxfd; i++)
+	drops += sockdrops[i];
+
+    elapsed = (now.tv_sec - cap.start.tv_sec) + (now.tv_nsec - cap.start.tv_nsec) / 1e9;
+    if (elapsed <= 0)
+	elapsed = 1e-9;
+    fprintf(stderr, "\nCaptured %lu packets, %llu bytes in %.3f sec: %.1f MB/s, %s%s\n",
+	    cap.pkts, (unsigned long long)cap.bytes, elapsed, cap.bytes / elapsed / 1e6,
+#ifdef HAVE_IO_URING
+	    cap.ring >= 0 ? "io_uring" :
+#endif
+	    "pwrite thread", cap.direct ? " + O_DIRECT" : "");
+    fprintf(stderr, "Writer stalls: %lu, %.3f ms total, %.3f ms max.  Kernel drops: %lu\n",
+	    cap.stalls, cap.stall_usec / 1000.0, cap.stall_max / 1000.0, drops);
+    if (cap.error)
+	fprintf(stderr, "Capture write error: %s\n", strerror(cap.error));
+}
+
+/* Map a destination address to its group, NULL if outside the range */
+struct group *lookup(struct in_addr dst)
+{
+    uint32_t idx = ntohl(dst.s_addr) - groupaddr;
+
+    if (idx >= (uint32_t)num_groups) {
+	stray++;
+	return NULL;
+    }
+
+    return &groups[idx];
+}
+
+/*
+ * The processing pipeline, the same for live traffic and pcap replay:
+ * optional capture to file, then either the stats stage (failover
+ * tracking) or the hex dump stage.
+ */
+void process(struct group *g, const char *buf, int length, const struct meta *m)
+{
+    if (capturing)
+	cap_packet(m, buf, length);
+
+    if (failover) {
+	track(g, buf, length, &m->tv);
+    } else if (!quiet && !capturing) {
+	if (num_groups > 1)
+	    printf("\n%s:", inet_ntoa(g->addr));
 	dump(buf,length);
+    }
+}
+
+static inline uint32_t swap32(uint32_t v, int swapped)
+{
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+/*
+ * Decode link, IPv4 and UDP headers of a captured frame.  Returns the
+ * UDP payload, or NULL for anything else.  Non-initial fragments have
+ * no UDP header and are skipped, as are truncated packets.
+ */
+const u_char *decode(const u_char *p, size_t caplen, uint32_t linktype,
+		     struct meta *m, size_t *len)
+{
+    size_t off, hlen, ulen;
+    uint16_t proto;
+
+    switch (linktype) {
+    case LINKTYPE_EN10MB:
+	if (caplen < 14)
+	    return NULL;
+	off = 12;
+	proto = p[off] << 8 | p[off + 1];
+	while ((proto == 0x8100 || proto == 0x88a8) && caplen >= off + 8) {
+	    off += 4;
+	    proto = p[off] << 8 | p[off + 1];
+	}
+	if (proto != 0x0800)
+	    return NULL;
+	off += 2;
+	break;
+
+    case LINKTYPE_SLL:
+	if (caplen < 16 || (p[14] << 8 | p[15]) != 0x0800)
+	    return NULL;
+	off = 16;
+	break;
+
+    case LINKTYPE_SLL2:
+	if (caplen < 20 || (p[0] << 8 | p[1]) != 0x0800)
+	    return NULL;
+	off = 20;
+	break;
+
+    case LINKTYPE_NULL:
+	off = 4;
+	break;
+
+    case LINKTYPE_RAW:
+    case 12:			/* LINKTYPE_RAW on OpenBSD */
+    case 14:			/* LINKTYPE_RAW on BSD/OS */
+	off = 0;
+	break;
+
+    default:
+	return NULL;
+    }
+
+    /* IPv4, UDP, unfragmented or first fragment */
+    if (caplen < off + 20 || (p[off] >> 4) != 4 || p[off + 9] != IPPROTO_UDP)
+	return NULL;
+    if ((p[off + 6] << 8 | p[off + 7]) & 0x1fff)
+	return NULL;
+    hlen = (p[off] & 0x0f) * 4;
+    m->from.sin_family = AF_INET;
+    memcpy(&m->from.sin_addr, &p[off + 12], sizeof(m->from.sin_addr));
+    memcpy(&m->dst, &p[off + 16], sizeof(m->dst));
+
+    off += hlen;
+    if (hlen < 20 || caplen < off + 8)
+	return NULL;
+    memcpy(&m->from.sin_port, &p[off], sizeof(m->from.sin_port));
+    m->dport = p[off + 2] << 8 | p[off + 3];
+    ulen   = p[off + 4] << 8 | p[off + 5];
+    if (ulen < 8)
+	return NULL;
+
+    off += 8;
+    *len = ulen - 8;
+    if (*len > caplen - off)
+	*len = caplen - off;
+
+    return p + off;
+}
+
+/*
+ * Feed UDP payloads from a pcap file through process(), as if they had
+ * been received live.  The file is mmap()ed, so neither reading nor
+ * decoding copies or allocates.  With @pace the recorded inter-packet
+ * times are reproduced, otherwise packets are replayed back-to-back.
+ */
+int replay(const char *file, int pace)
+{
+    const struct pcap_hdr *hdr;
+    const u_char *base, *p, *end;
+    struct timespec start, now;
+    struct timeval lastscan = { 0, 0 };
+    unsigned long pkts = 0, bytes = 0, skipped = 0;
+    int64_t first = -1;
+    struct stat st;
+    int fd, swapped, nsec;
+    double elapsed;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+	perror(file);
+	return 1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+	fprintf(stderr, "%s: too short for a pcap file\n", file);
+	return 1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+
+    hdr = (const struct pcap_hdr *)base;
+    switch (hdr->magic) {
+    case PCAP_MAGIC:
+    case PCAP_MAGIC_NSEC:
+	swapped = 0;
+	break;
+
+    default:
+	swapped = 1;
+	if (__builtin_bswap32(hdr->magic) == PCAP_MAGIC ||
+	    __builtin_bswap32(hdr->magic) == PCAP_MAGIC_NSEC)
+	    break;
+	fprintf(stderr, "%s: not a pcap file\n", file);
+	return 1;
+    }
+    nsec = swap32(hdr->magic, swapped) == PCAP_MAGIC_NSEC;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    p   = base + sizeof(*hdr);
+    end = base + st.st_size;
+    while (running && p + sizeof(struct pcap_rec) <= end) {
+	const struct pcap_rec *rec = (const struct pcap_rec *)p;
+	const u_char *payload;
+	struct group *g;
+	struct meta m;
+	size_t caplen, len;
+
+	caplen = swap32(rec->caplen, swapped);
+	p += sizeof(*rec);
+	if (p + caplen > end)
+	    break;
+
+	memset(&m, 0, sizeof(m));
+	m.tv.tv_sec  = swap32(rec->sec, swapped);
+	m.tv.tv_usec = swap32(rec->usec, swapped);
+	if (nsec)
+	    m.tv.tv_usec /= 1000;
+
+	payload = decode(p, caplen, swap32(hdr->linktype, swapped), &m, &len);
+	p += caplen;
+	if (!payload || m.dport != groupport) {
+	    skipped++;
+	    continue;
+	}
+
+	if (pace) {
+	    int64_t due, lag;
+
+	    if (first < 0)
+		first = USEC(m.tv);
+	    due = USEC(m.tv) - first;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    lag = (now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000;
+	    if (due > lag) {
+		struct timespec ts = { (due - lag) / 1000000, (due - lag) % 1000000 * 1000 };
+
+		nanosleep(&ts, NULL);
+	    }
+	}
+
+	g = lookup(m.dst);
+	if (!g)
+	    continue;
+
+	process(g, (const char *)payload, len, &m);
+	pkts++;
+	bytes += len;
+
+	/* Outage scan runs on recorded time, not wall clock */
+	if (failover && USEC(m.tv) - USEC(lastscan) > threshold / 2) {
+	    if (lastscan.tv_sec)
+		scan(&m.tv);
+	    lastscan = m.tv;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    munmap((void *)base, st.st_size);
+
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    if (elapsed <= 0)
+	elapsed = 1e-9;
+    fprintf(stderr, "\nReplayed %lu packets, %lu bytes in %.3f sec: %.0f pps, %.1f MB/s"
+	    " (%lu skipped, %lu outside group range)\n", pkts, bytes, elapsed,
+	    pkts / elapsed, bytes / elapsed / 1e6, skipped, stray);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, epfd, length, catchall = 0, pace = 0;
+    char buf[MAXPDU];
+    struct in_addr ifaddr;
+    struct epoll_event ev, events[MAXEVENTS];
+    struct timeval tv, lastscan;
+    struct meta m;
+    char *interface = NULL, *file = NULL, *wfile = NULL;
+
+    while ((c = getopt(argc, argv, "b:cfhln:o:qr:Rw:")) != EOF) {
+	switch (c) {
+	case 'b':
+	    busy_poll = 1;
+	    latency = 1;
+	    spin_budget = atol(optarg);
+	    break;
+
+	case 'c':
+	    catchall = 1;
+	    break;
+
+	case 'f':
+	    failover = 1;
+	    break;
+
+	case 'l':
+	    latency = 1;
+	    break;
+
+	case 'n':
+	    num_groups = atoi(optarg);
+	    if (num_groups < 1)
+		return usage(argv[0]);
+	    break;
+
+	case 'o':
+	    threshold = (int64_t)atoi(optarg) * 1000;
+	    break;
+
+	case 'q':
+	    quiet = 1;
+	    break;
+
+	case 'r':
+	    file = optarg;
+	    break;
+
+	case 'R':
+	    pace = 1;
+	    break;
+
+	case 'w':
+	    wfile = optarg;
+	    capturing = 1;
+	    break;
+
+	default:
+	    return usage(argv[0]);
+	}
+    }
+
+    if (argc - optind > 3)
+	return usage(argv[0]);
+
+    if (optind < argc) {
+	groupaddr = ntohl(inet_addr(argv[optind++]));
+    }
+
+    if (optind < argc) {
+	groupport = (u_short)atoi(argv[optind++]);
+    }
+
+    if (optind < argc) {
+	interface = argv[optind++];
     }    
-    close(sock);
+
+    if (interface) {
+	ifaddr.s_addr = inet_addr(interface);
+    } else {
+	ifaddr.s_addr = htonl(INADDR_ANY);
+    }
+
+    groups = calloc(num_groups, sizeof(struct group));
+    if (!groups) {
+	perror("calloc");
+	exit(1);
+    }
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+	perror("epoll_create1");
+	exit(1);
+    }
+
+    /*
+     * Epoll busy polling is set on the epoll instance, the sockets'
+     * SO_BUSY_POLL only applies to blocking reads.  It only polls NICs
+     * with NAPI IDs, on anything else -b is just the spin in spin().
+     */
+    if (busy_poll) {
+	struct epoll_params ep = { BUSY_POLL_USEC, 8, 1, 0 };
+
+	if (ioctl(epfd, EPIOCSPARAMS, &ep))
+	    perror("Warning: ioctl(EPIOCSPARAMS), spinning in userspace only");
+    }
+
+    for (i = 0; i < num_groups; i++)
+	groups[i].addr.s_addr = htonl(groupaddr + i);
+
+    signal(SIGINT, sigcb);
+    signal(SIGTERM, sigcb);
+
+    if (wfile && cap_open(wfile))
+	exit(1);
+
+    if (file) {
+	if (replay(file, pace))
+	    exit(1);
+	if (failover)
+	    summary(NULL);
+	if (capturing)
+	    cap_close();
+	free(groups);
+
+	return 0;
+    }
+
+    fdlimit(num_groups);
+    maxfd = sysconf(_SC_OPEN_MAX);
+    sockdrops = calloc(maxfd, sizeof(uint32_t));
+    if (!sockdrops) {
+	perror("calloc");
+	exit(1);
+    }
+
+    if (catchall) {
+	open_catchall(epfd, ifaddr);
+    } else {
+	for (i = 0; i < num_groups; i++) {
+	    groups[i].sock = open_group(groups[i].addr, ifaddr);
+	    ev.events = EPOLLIN;
+	    ev.data.u64 = i;
+	    if (epoll_ctl(epfd, EPOLL_CTL_ADD, groups[i].sock, &ev)) {
+		perror("epoll_ctl");
+		exit(1);
+	    }
+	}
+    }
+
+    if (failover)
+	printf("Tracking %d groups from %s:%d, outage threshold %lld ms\n",
+	       num_groups, inet_ntoa(groups[0].addr), groupport,
+	       (long long)(threshold / 1000));
+
+    gettimeofday(&lastscan, NULL);
+    while (running) {
+	int num, timeout = -1;
+
+	if (failover)
+	    timeout = threshold / 2000 + 1;
+
+	if (busy_poll)
+	    num = spin(epfd, events, timeout);
+	else
+	    num = epoll_wait(epfd, events, MAXEVENTS, timeout);
+	if (num < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    exit(1);
+	}
+
+	for (i = 0; i < num; i++) {
+	    uint64_t tag = events[i].data.u64;
+	    struct group *g = NULL;
+	    int sock;
+
+	    /* Catch-all sockets carry no group, only the fd */
+	    if (tag & CATCHALL) {
+		sock = (int)(tag & ~CATCHALL);
+	    } else {
+		g = &groups[tag];
+		sock = g->sock;
+	    }
+	    memset(&m, 0, sizeof(m));
+	    length = receive(sock, buf, sizeof(buf), &m);
+	    if (length < 0) {
+		perror("recv");
+		exit(1);
+	    }
+
+	    if (latency) {
+		struct timeval now;
+		int64_t delay;
+
+		gettimeofday(&now, NULL);
+		delay = USEC(now) - USEC(m.tv);
+		if (delay < 0)
+		    delay = 0;
+		lathist[delay < LATMAX ? delay : LATMAX]++;
+	    }
+
+	    if (!g) {
+		g = lookup(m.dst);
+		if (!g)
+		    continue;
+	    }
+	    g->ifindex = m.ifindex;
+
+	    process(g, buf, length, &m);
+	}
+
+	if (failover) {
+	    gettimeofday(&tv, NULL);
+	    if (USEC(tv) - USEC(lastscan) > threshold / 2) {
+		scan(&tv);
+		lastscan = tv;
+	    }
+	}
+    }
+
+    if (failover) {
+	gettimeofday(&tv, NULL);
+	summary(&tv);
+    }
+    if (latency)
+	distribution();
+    if (capturing)
+	cap_close();
+
+    close(epfd);
+    free(groups);
 
     return 0;
 }
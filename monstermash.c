@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -11,7 +15,9 @@
 #include <net/if.h>
 #include <netinet/in.h>
 
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -28,6 +34,10 @@
  * and receives:
  * anything unicast in on tport/myaddress, multicast from lport to 
  * rport/multicast (group)
+ *
+ * With -E the unicast leg is a tunnel: each packet carries a small
+ * header naming the group and port it was sent to, so one pair of
+ * mashes can bridge any number of groups over the one socket.
  */
 
 #define MULTICAST
@@ -37,6 +47,10 @@
 #define BUFFER_SIZE	1024
 #define RECEIVE_PORT	2000
 #define TRANSMIT_PORT	2000
+#define BATCH		64	/* datagrams per recvmmsg() */
+#define MAXVEC		1024	/* most a sendmmsg() takes, UIO_MAXIOV */
+#define QUEUE		1024	/* packets queued per site, -Q */
+#define BURST_MS	20	/* a site's token bucket holds this long at its rate */
 
 #ifndef INADDR_NONE
 #define INADDR_NONE     0xffffffff      /* should be in <netinet/in.h> */
@@ -44,13 +58,32 @@
 
 int   r_port; /* we receive multicast on and send multicast to*/
 int   t_port; /* we send unicast from and to... */
+/*
+ * Sites.  Each has its own socket, bound to t_port and connected, so
+ * one that's unreachable or slow only ever fails its own sends, and a
+ * bounded queue that's drained with non-blocking sendmmsg()es as its
+ * token bucket allows.  Full, it drops the newest packet, or with -O
+ * the oldest.
+ */
 struct dh {
 	int sockfd;
 	char *host_name;
 	unsigned int port;
+	unsigned int rate;		/* kbit/s, 0 unlimited */
 	struct sockaddr_in their_u_address;
+	char *q;			/* qsize slots of slotsize, length first */
+	unsigned head, tail;		/* free running, tail - head queued */
+	double tokens, burst;		/* bytes */
+	struct timespec fill;
+	int blocked;			/* send buffer full, wait for EPOLLOUT */
+	unsigned long sent, dropped, errors;
 } unicast_sites[FD_SETSIZE];
 int nunicast_sites;
+unsigned qsize = QUEUE;
+int      slotsize;
+int      drop_oldest;		/* -O */
+unsigned rate;			/* -R, for sites without their own */
+int      throttled;		/* sites waiting on tokens */
 
 char* group_name;
 
@@ -58,8 +91,113 @@ int   bufsiz;
 int   unicast = -1, multicast = -1;
 char* buf;
 unsigned char ttl = 1; /* default... */
+int   interval; /* seconds between statistics, 0 only at exit */
+
+/*
+ * Tunnel header, all in network byte order.  source is whoever sent
+ * the packet to the group at the near end, it can't be kept as the IP
+ * source so it rides along here.
+ */
+#define TUNNEL_VERSION	1
+struct tunnel {
+	uint8_t  version;
+	uint8_t  flags;		/* none yet, zero */
+	uint16_t port;
+	uint32_t group;
+	uint32_t source;
+};
+
+/*
+ * Groups we relay, and a hash of them on (group, port) so the far end
+ * can find where a tunnelled packet goes.  fd is the socket the group
+ * was joined on.
+ */
+struct group {
+	struct sockaddr_in addr;
+	int fd;
+	int next;		/* hash chain, -1 ends */
+	unsigned long in, out;
+} *groups;
+int ngroups;
+int *buckets, hbits;
+
+/*
+ * Receive sockets, one per port until the kernel won't take any more
+ * memberships on it (igmp_max_memberships), then another.
+ */
+struct msock {
+	int fd;
+	int port;
+	int full;
+} *msocks;
+int nmsocks;
+int m_fd;			/* multicast goes out on this */
+int ep;				/* epoll */
+int tunnel;			/* -E */
+
+/*
+ * Duplicate suppression, -D.  Relays meshed for redundancy hand each
+ * other copies of the same packet, and round a loop of them one would
+ * go for ever.  So every packet relayed is remembered, by a hash of its
+ * payload and the group and port it's for, and one seen again within
+ * the window is dropped.  A relay re-multicasts from its own address,
+ * so the sender's address can't be in the key: round a loop the copy
+ * comes back from someone else.
+ *
+ * The memory is fixed: buckets of WAYS entries, each the rest of the
+ * hash and when it was seen.  A new packet takes the oldest entry in
+ * its bucket, so a cache too small for the rate forgets early, and
+ * lets a duplicate by, it never grows.
+ */
+#define WAYS		4
+#define CACHE_SIZE	65536	/* entries, -C */
+struct seen {
+	uint32_t tag;		/* 0 is empty */
+	uint32_t when;		/* msec */
+} *cache;
+uint32_t cache_mask;		/* buckets - 1 */
+int      cache_size = CACHE_SIZE;
+int      window;		/* msec, 0 off */
+uint32_t now_ms;
+unsigned long m_dup, u_dup, evicted;
+
+/*
+ * Batches.  in[] is filled by one recvmmsg(), each slot with its own
+ * part of buf.  out[] is a batch on its way to the groups in one
+ * sendmmsg(), and qout[] one from a site's queue.
+ */
+#define EV_SITE		(1ULL << 63)	/* epoll: site index above the fd */
+struct mmsghdr in[BATCH];
+struct iovec   in_iov[BATCH], out_iov[BATCH], qiov[BATCH];
+struct mmsghdr out[BATCH], qout[BATCH];
+struct sockaddr_in from[BATCH];
+char ctl[BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+
+/* statistics */
+unsigned long m_in, m_out, u_in, u_out;
+unsigned long recv_calls, send_calls, wait_calls;
+unsigned long u_unknown;	/* tunnelled for a group we don't have */
+unsigned long u_errors;		/* multicast sends that failed */
+volatile sig_atomic_t stop;
+struct timespec started;
 
 void check(int n);
+void done(int signo);
+void parse_groups(char *spec, struct in_addr *ifaddr);
+void join_groups(struct in_addr ifaddr);
+int  find_group(uint32_t group, uint16_t port);
+int  open_msock(int port, struct in_addr ifaddr);
+void prepare(int len, int names);
+int  dest_group(int i, int port);
+int  duplicate(struct group *g, char *p, int len);
+uint32_t msec(void);
+void enqueue(struct dh *us, struct tunnel *t, char *p, int len);
+void drain(struct dh *us);
+void drain_all(void);
+void site_events(struct dh *us, int out);
+void relay_multicast(int fd, int port);
+void relay_unicast(int fd);
+void stats(int final);
 
 void get_options(argc,argv)
 int argc;
@@ -75,6 +213,13 @@ char *argv[];
   *        -b <buffer_size>
   *        -M turn off multicast reception
   *        -U turn off unicast reception
+  *        -S <seconds between statistics>
+  *        -E tunnel, with the group in a header
+  *        -D <msec to drop duplicates for>
+  *        -C <duplicate cache entries>
+  *        -Q <packets queued per site>
+  *        -R <kbit/s per site, unless the site says>
+  *        -O drop the oldest from a full queue, not the newest
   */
 {
   void usage();
@@ -108,6 +253,34 @@ char *argv[];
         multicast = 0;
         break;
 
+      case 'S':		/* statistics interval */
+        interval = atoi(++*argv);
+        break;
+
+      case 'E':		/* encapsulate */
+        tunnel = 1;
+        break;
+
+      case 'D':		/* duplicate window */
+        window = atoi(++*argv);
+        break;
+
+      case 'C':		/* duplicate cache size */
+        cache_size = atoi(++*argv);
+        break;
+
+      case 'Q':		/* queue length */
+        qsize = atoi(++*argv);
+        break;
+
+      case 'R':		/* rate limit */
+        rate = atoi(++*argv);
+        break;
+
+      case 'O':		/* drop oldest */
+        drop_oldest = 1;
+        break;
+
       default:
         usage(name);
         exit(1);
@@ -119,15 +292,17 @@ char *argv[];
     exit (1);
   }
   while (argc-- > 1) {
-    if(sscanf(*argv, "%s %d", unicast_sites[nunicast_sites].host_name,
-		&unicast_sites[nunicast_sites].port) != 2 ) {
+    unicast_sites[nunicast_sites].rate = rate;
+    if(sscanf(*argv, "%s %d %u", unicast_sites[nunicast_sites].host_name,
+		&unicast_sites[nunicast_sites].port,
+		&unicast_sites[nunicast_sites].rate) < 2 ) {
 	fprintf(stderr, "bad unicast args\n" );
 	exit(-1);
     }
     argv++;
     nunicast_sites++;
   }
-  strcpy(group_name, *argv);
+  group_name = *argv;
 }
 
 
@@ -139,8 +314,6 @@ void set_defaults()
 	  bzero(unicast_sites[i].host_name, HOST_NAME_SIZE);
 	  bzero( (char *)&unicast_sites[i].their_u_address, sizeof(struct sockaddr_in) );
   }
-  group_name = (char *)malloc(HOST_NAME_SIZE);
-  bzero(group_name, HOST_NAME_SIZE);
 
   r_port = RECEIVE_PORT;
   t_port = TRANSMIT_PORT; /* private pipe port */
@@ -149,51 +322,66 @@ void set_defaults()
 
 int main(int argc, char *argv[])
 {
-  int r_fd;
   int t_fd;
   struct dh *us;
-  int nread = 0, nwrite;
-
-/* at least 4 addresses */
-/* bound r_fd, r_port receive (and send to) multicast */
-  struct sockaddr_in our_m_address;       
-  struct sockaddr_in their_m_address;       
 
+/* bound msocks, r_port (or each group's port) receive multicast */
 /* bound t_fd, receive and send from) unicast  */
   struct sockaddr_in our_u_address;	  /* our unicast addr */
-
-  unsigned i1, i2, i3, i4, g1, g2, g3, g4, z1;
-  struct ip_mreq imr;
+  struct in_addr ifaddr;
 
   unsigned long inaddr;
   struct hostent *host_info;               /* From gethostbyname   */
-  unsigned char no = 0;
-  int udest;
+  int udest, on = 1, off = 0;
 
   /*
    * Initialise data structures
    */
-  bzero( (char *)&our_m_address, sizeof(our_m_address) );
-
   set_defaults();
   get_options(argc, argv);
-  buf = (char *)malloc(bufsiz);
-  bzero(buf, bufsiz);
-
-  /*
-   * Create a socket to receive on
-   */
-  if ( (r_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
-    perror("Couldn't create the socket");
-    exit(1);
+  /* a slot takes a tunnelled packet of bufsiz, header and all */
+  buf = (char *)malloc((bufsiz + sizeof(struct tunnel)) * BATCH);
+  bzero(buf, (bufsiz + sizeof(struct tunnel)) * BATCH);
+  /* queue slots, a whole tunnelled packet and its length, aligned */
+  slotsize = (sizeof(int) + sizeof(struct tunnel) + bufsiz + 7) & ~7;
+  for (udest = 1; (unsigned)udest < qsize; udest <<= 1)
+    ;
+  qsize = udest;		/* a power of two, the ring masks */
+  if (window) {
+    for (cache_mask = 1; cache_mask * WAYS < (unsigned)cache_size; cache_mask <<= 1)
+      ;
+    cache = (struct seen *)calloc(cache_mask * WAYS, sizeof(*cache));
+    if (!cache) {
+      perror("Couldn't allocate duplicate cache");
+      exit(1);
+    }
+    printf("Dropping duplicates within %d msec, %u entries\n", window, cache_mask * WAYS);
+    cache_mask--;
   }
 
-  /* Create a socket to transmit on */
+  /* Create a socket to receive from anyone else on */
   if ( (t_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
   { 
     perror("Couldn't create the socket");
     exit(1);
   }
+  setsockopt(t_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  /* it may share r_port, and must not hear the groups joined there */
+  setsockopt(t_fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+
+  our_u_address.sin_family      = AF_INET;
+
+  if (unicast)
+	our_u_address.sin_port        = htons(t_port);
+  else
+	our_u_address.sin_port        = 0;
+  our_u_address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(t_fd, (struct sockaddr *)&our_u_address, sizeof(our_u_address)) < 0) { 
+    perror("Couldn't bind the unicast socket");
+    exit(1);
+  }
+
   for(udest = 0, us = unicast_sites; udest <nunicast_sites; udest++, us++) {
 	/* Now associate some information with it.  */
 	us->their_u_address.sin_family = AF_INET;
@@ -210,119 +398,152 @@ int main(int argc, char *argv[])
 		bcopy(host_info->h_addr, (char *)&us->their_u_address.sin_addr,
 		  host_info->h_length);
 	}
-	printf("Transmitting to machine %s, port %d\n", us->host_name, us->port);
+
+	/* and a socket, and a queue, of its own */
+	if ( (us->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+		perror("Couldn't create the socket");
+		exit(1);
+	}
+	setsockopt(us->sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(us->sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+	if (bind(us->sockfd, (struct sockaddr *)&our_u_address, sizeof(our_u_address)) < 0) {
+		perror("Couldn't bind the unicast socket");
+		exit(1);
+	}
+	/* no route yet is the site's problem, not a reason not to start */
+	if (connect(us->sockfd, (struct sockaddr *)&us->their_u_address,
+		    sizeof(us->their_u_address)) < 0)
+		perror(us->host_name);
+	if (!(us->q = (char *)malloc(qsize * slotsize))) {
+		perror("Couldn't allocate queue");
+		exit(1);
+	}
+	us->burst = us->rate * 125.0 * BURST_MS / 1000;
+	if (us->burst < slotsize)
+		us->burst = slotsize;
+	us->tokens = us->burst;
+	clock_gettime(CLOCK_MONOTONIC, &us->fill);
+
+	printf("Transmitting to machine %s, port %d", us->host_name, us->port);
+	if (us->rate)
+		printf(" at %u kbit/s", us->rate);
+	printf("\n");
   }
 /* 
- * now join appropriate group
+ * now join appropriate groups
  */
-  if(sscanf( group_name, "%u.%u.%u.%u %u.%u.%u.%u %u",
-		&g1, &g2, &g3, &g4, &i1, &i2, &i3, &i4, &z1 ) != 8 ) {
-	fprintf(stderr, "bad group args %s\n", group_name);
-	exit(-1);
-  }
-  imr.imr_multiaddr.s_addr = (g1<<24) | (g2<<16) | (g3<<8) | g4;
-  imr.imr_multiaddr.s_addr = htonl(imr.imr_multiaddr.s_addr);
-  imr.imr_interface.s_addr = (i1<<24) | (i2<<16) | (i3<<8) | i4;
-  imr.imr_interface.s_addr = htonl(imr.imr_interface.s_addr);
-  if(setsockopt(r_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, 
-		&imr, sizeof(struct ip_mreq) ) == -1 ) {
-	perror( "can't join group" );
+  parse_groups(group_name, &ifaddr);
+  if (ngroups > 1 && !tunnel) {
+	fprintf(stderr, "%d groups need a tunnel, -E\n", ngroups);
 	exit(-1);
-  } else {
-	printf( "group joined\n" );
   }
-  if (multicast)
-	setsockopt(r_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof(no));
-
-  their_m_address.sin_family      = AF_INET;
-  their_m_address.sin_port        = htons(r_port);
-  bcopy(&imr.imr_multiaddr.s_addr, &their_m_address.sin_addr, 4);
-
-  our_m_address.sin_family      = AF_INET;
-  if (multicast)
-	our_m_address.sin_port        = htons(r_port);
-  else
-	our_m_address.sin_port = 0;
-  our_m_address.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (bind(r_fd, (struct sockaddr *)&our_m_address, sizeof(our_m_address)) < 0) { 
-    perror("Couldn't bind the multicast socket");
-    exit(1);
-  }
-  /* Set the TTL of multicast packets to 32  */
-  {
-    setsockopt(r_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
-  }
-
-  our_u_address.sin_family      = AF_INET;
-
-  if (unicast)
-	our_u_address.sin_port        = htons(t_port);
-  else
-	our_u_address.sin_port        = 0;
-  our_u_address.sin_addr.s_addr = htonl(INADDR_ANY);
+  join_groups(ifaddr);
+  printf( "%d group%s joined on %d socket%s\n", ngroups, ngroups == 1 ? "" : "s",
+	nmsocks, nmsocks == 1 ? "" : "s" );
 
-  if (bind(t_fd, (struct sockaddr *)&our_u_address, sizeof(our_u_address)) < 0) { 
-    perror("Couldn't bind the unicast socket");
-    exit(1);
-  }
+  /*
+   * Multicast out: plain relaying sends from the group's own socket,
+   * as it always has.  A tunnel's groups can't share a sendmmsg()
+   * that way, so they all go from one socket of their own.
+   */
+  m_fd = tunnel ? open_msock(0, ifaddr) : groups[0].fd;
 
-  printf("Listening on port %d\n", r_port);
+  printf("Listening on port %d%s\n", r_port, tunnel ? ", tunnelling" : "");
   printf("Bufersize = %d\n", bufsiz);
   
   /*
    * And bounce the input
    * not a simple echo, rather a UDP router:
-   * in on r_fd (multicast) gets sent on t_fd (unicast)
-   * in on t_fd (unicast) gets multicast on r_fd
+   * in on a group's socket (multicast) gets queued for each site
+   * in on t_fd or a site's socket (unicast) gets multicast on m_fd
+   *
+   * All are edge-triggered in epoll, so each wakeup drains its socket
+   * in recvmmsg() batches.  A batch to the groups goes out in one
+   * sendmmsg(), and each site's queue in as few as its rate allows;
+   * a site's socket that fills waits for EPOLLOUT, asked for only
+   * then, and one that's short of tokens for the next millisecond.
    */
-  do { 
-    socklen_t msg_len;
-    int sel;
-    fd_set sofl;
-
-    FD_ZERO  (&sofl);
-    if (multicast)
-	    FD_SET(r_fd, &sofl);
-    if (unicast)
-	    FD_SET(t_fd, &sofl);
-    sel = select(FD_SETSIZE, &sofl, (fd_set *)0, (fd_set *)0, NULL);
-    if (sel < 0) {
-	perror("select");
-	exit(-1);
-    } else if (sel > 0) {
-	if (FD_ISSET(r_fd, &sofl)) {
-#ifdef DEBUG
-	fprintf(stderr, "m");
-#endif
-	    nread = recvfrom(r_fd, buf, bufsiz, 0, NULL, &msg_len);
-	    check(nread);
-	    for(udest = 0, us = unicast_sites; udest <nunicast_sites; udest++, us++) {
-		    nwrite = sendto(t_fd, buf, nread, 0, 
-                                    (struct sockaddr *)&(us->their_u_address), 
-                                    sizeof(struct sockaddr_in));
-		    check(nwrite);
-	    }
-	}
-	if (FD_ISSET(t_fd, &sofl)) {
-#ifdef DEBUG
-fprintf(stderr, "u");
-#endif
-	    nread = recvfrom(t_fd, buf, bufsiz, 0, NULL, &msg_len);
-	    check(nread);
-	    nwrite = sendto(r_fd, buf, nread, 0, 
-                            (struct sockaddr *)&their_m_address, sizeof(their_m_address));
-	    check(nwrite);
-	}
-    } else { /* assert (sel == 0) - but timeout infinite! */
-	fprintf(stderr, "Timeout after infinity!\n");
-	exit(-1);
+  {
+    struct epoll_event ev, evs[BATCH];
+    struct timespec last, now;
+    int n;
+
+    for (n = 0; n < BATCH; n++) {
+      in_iov[n].iov_base = buf + n * (bufsiz + sizeof(struct tunnel));
+      in[n].msg_hdr.msg_iov    = &in_iov[n];
+      in[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((ep = epoll_create1(0)) < 0) {
+      perror("epoll_create1");
+      exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    /* the port rides in the top half, relay_multicast() wants it */
+    for (n = 0; multicast && n < nmsocks; n++) {
+      ev.data.u64 = (uint64_t)msocks[n].port << 32 | msocks[n].fd;
+      check(epoll_ctl(ep, EPOLL_CTL_ADD, msocks[n].fd, &ev));
+    }
+    if (unicast) {
+      ev.data.u64 = t_fd;
+      check(epoll_ctl(ep, EPOLL_CTL_ADD, t_fd, &ev));
+    }
+    /* what a site sends us comes in on its own, connected, socket */
+    ev.events = EPOLLET | (unicast ? EPOLLIN : 0);
+    for (udest = 0, us = unicast_sites; udest < nunicast_sites; udest++, us++) {
+      ev.data.u64 = EV_SITE | (uint64_t)udest << 32 | us->sockfd;
+      check(epoll_ctl(ep, EPOLL_CTL_ADD, us->sockfd, &ev));
     }
-  } while (nread > 0);
+
+    signal(SIGINT, done);
+    signal(SIGTERM, done);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    last = started;
+    while (!stop) {
+      n = epoll_wait(ep, evs, BATCH, throttled ? 1 : interval ? 1000 : -1);
+      wait_calls++;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("epoll_wait");
+        exit(-1);
+      }
+      while (n-- > 0) {
+        int fd = (int)(evs[n].data.u64 & 0xffffffff);
+
+        if (evs[n].data.u64 & EV_SITE) {
+          us = &unicast_sites[(evs[n].data.u64 >> 32) & 0xffff];
+          if (evs[n].events & EPOLLOUT) {
+            us->blocked = 0;
+            site_events(us, 0);
+          }
+          if (evs[n].events & EPOLLIN)
+            relay_unicast(fd);
+        } else if (fd == t_fd)
+          relay_unicast(t_fd);
+        else
+          relay_multicast(fd, (int)(evs[n].data.u64 >> 32));
+      }
+      drain_all();
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (interval && now.tv_sec - last.tv_sec >= interval) {
+        stats(0);
+        last = now;
+      }
+    }
+    stats(1);
+  }
 
   /*
    * Finally, close the sockets.
    */
-  close(r_fd);
+  for (udest = 0; udest < nmsocks; udest++)
+    close(msocks[udest].fd);
+  if (tunnel)
+    close(m_fd);
+  for (udest = 0, us = unicast_sites; udest < nunicast_sites; udest++, us++)
+    close(us->sockfd);
   close(t_fd);
 
   exit(0);
@@ -332,7 +553,570 @@ fprintf(stderr, "u");
 void usage(name)
 char *name;
 {
-  fprintf(stderr, "Usage %s: [-r <receive_port>] [-t <transmit_port>] [-b <bufer_size>] [-T ttl] [-U] [-M] {\"other_host port\"}+ <\"group_name\">\n", name);
+  fprintf(stderr, "Usage %s: [-r <receive_port>] [-t <transmit_port>] [-b <bufer_size>] [-T ttl] [-U] [-M] [-S <secs>] [-E] [-D <msec>] [-C <entries>] [-Q <packets>] [-R <kbit/s>] [-O] {\"other_host port [kbit/s]\"}+ <\"group[+n][:port][,...] interface\">\n", name);
+}
+
+void done(int signo)
+{
+	(void)signo;
+	stop = 1;
+}
+
+/*
+ * Send a whole vector, in as few calls as sendmmsg() allows.  A message
+ * that fails is counted and skipped, like drain() does for a site.
+ */
+int sendv(int fd, struct mmsghdr *v, int k)
+{
+	int tried = 0, sent = 0, n;
+
+	while (tried < k) {
+		n = sendmmsg(fd, v + tried, k - tried > MAXVEC ? MAXVEC : k - tried, 0);
+		send_calls++;
+		if (n < 0) {
+			u_errors++;
+			tried++;
+			continue;
+		}
+		tried += n;
+		sent += n;
+	}
+	return sent;
+}
+
+/*
+ * "g.g.g.g[+n][:port][,...] i.i.i.i": groups, each the first of a run
+ * of n consecutive addresses, on r_port unless a port is given, all
+ * joined on interface i.
+ */
+void parse_groups(char *spec, struct in_addr *ifaddr)
+{
+	char *list, *iface, *g;
+	unsigned g1, g2, g3, g4, port;
+	unsigned long n;
+	uint32_t first;
+	int i, h;
+
+	list = strdup(spec);
+	if (!(iface = strchr(list, ' ')) || !inet_aton(iface + 1, ifaddr)) {
+		fprintf(stderr, "bad group args %s\n", spec);
+		exit(-1);
+	}
+	*iface = 0;
+
+	for (g = strtok(list, ","); g; g = strtok(NULL, ",")) {
+		char *p = g;
+
+		if (sscanf(p, "%u.%u.%u.%u", &g1, &g2, &g3, &g4) != 4 ||
+		    g1 > 255 || g2 > 255 || g3 > 255 || g4 > 255) {
+			fprintf(stderr, "bad group %s\n", g);
+			exit(-1);
+		}
+		first = (g1<<24) | (g2<<16) | (g3<<8) | g4;
+		n = 1;
+		port = r_port;
+		p += strcspn(p, "+:");
+		if (*p == '+')
+			n = strtoul(p + 1, &p, 10);
+		if (*p == ':')
+			port = strtoul(p + 1, &p, 10);
+		/* the whole range, not just its end, must be class D */
+		if (*p || !n || n - 1 > 0xffffffffUL - first || port > 65535 ||
+		    !IN_MULTICAST(first) || !IN_MULTICAST(first + n - 1)) {
+			fprintf(stderr, "bad group %s\n", g);
+			exit(-1);
+		}
+		while (n--) {
+			struct group *gr;
+
+			if (ngroups % 64 == 0 &&
+			    !(groups = realloc(groups, (ngroups + 64) * sizeof(*groups)))) {
+				perror("Couldn't allocate groups");
+				exit(1);
+			}
+			gr = &groups[ngroups++];
+			bzero(gr, sizeof(*gr));
+			gr->addr.sin_family      = AF_INET;
+			gr->addr.sin_port        = htons(port);
+			gr->addr.sin_addr.s_addr = htonl(first++);
+			gr->fd = -1;
+		}
+	}
+	free(list);
+
+	/* at most half full, so chains stay a probe or two */
+	for (hbits = 4; (1 << hbits) < 2 * ngroups; hbits++)
+		;
+	buckets = malloc(sizeof(int) << hbits);
+	memset(buckets, -1, sizeof(int) << hbits);
+	for (i = 0; i < ngroups; i++) {
+		struct group *gr = &groups[i];
+
+		if (find_group(gr->addr.sin_addr.s_addr, gr->addr.sin_port) >= 0) {
+			fprintf(stderr, "group %s:%d given twice\n",
+				inet_ntoa(gr->addr.sin_addr), ntohs(gr->addr.sin_port));
+			exit(-1);
+		}
+		h = ((gr->addr.sin_addr.s_addr ^ (uint32_t)gr->addr.sin_port << 16)
+		     * 2654435761u) >> (32 - hbits);
+		gr->next = buckets[h];
+		buckets[h] = i;
+	}
+}
+
+/* Index of group:port, both network order, or -1 */
+int find_group(uint32_t group, uint16_t port)
+{
+	int i = buckets[((group ^ (uint32_t)port << 16) * 2654435761u) >> (32 - hbits)];
+
+	while (i >= 0 && (groups[i].addr.sin_addr.s_addr != group ||
+			  groups[i].addr.sin_port != port))
+		i = groups[i].next;
+	return i;
+}
+
+/*
+ * A multicast socket on port, 0 for one that only sends.  It gets only
+ * the groups joined on it (IP_MULTICAST_ALL off) and says which one
+ * each packet was for (IP_PKTINFO).
+ */
+int open_msock(int port, struct in_addr ifaddr)
+{
+	struct sockaddr_in sin;
+	unsigned char no = 0;
+	int fd, on = 1, off = 0;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("Couldn't create the socket");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+	setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	if (multicast)
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof(no));
+	if (ifaddr.s_addr != INADDR_ANY)
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+
+	bzero(&sin, sizeof(sin));
+	sin.sin_family      = AF_INET;
+	sin.sin_port        = multicast ? htons(port) : 0;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("Couldn't bind the multicast socket");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Join every group, on a socket bound to its port with room left */
+void join_groups(struct in_addr ifaddr)
+{
+	struct ip_mreq imr;
+	struct group *g;
+	int i, j, port;
+
+	imr.imr_interface = ifaddr;
+	for (i = 0, g = groups; i < ngroups; i++, g++) {
+		port = ntohs(g->addr.sin_port);
+		imr.imr_multiaddr = g->addr.sin_addr;
+		for (j = 0; g->fd < 0; j++) {
+			if (j == nmsocks) {
+				if (nmsocks % 16 == 0 &&
+				    !(msocks = realloc(msocks, (nmsocks + 16) * sizeof(*msocks)))) {
+					perror("Couldn't allocate sockets");
+					exit(1);
+				}
+				msocks[j].fd   = open_msock(port, ifaddr);
+				msocks[j].port = port;
+				msocks[j].full = 0;
+				nmsocks++;
+			}
+			if (msocks[j].port != port || msocks[j].full)
+				continue;
+			if (setsockopt(msocks[j].fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+				       &imr, sizeof(imr)) == 0)
+				g->fd = msocks[j].fd;
+			else if (errno == ENOBUFS)
+				msocks[j].full = 1;
+			else {
+				fprintf(stderr, "%s: ", inet_ntoa(g->addr.sin_addr));
+				perror("can't join group");
+				exit(-1);
+			}
+		}
+	}
+}
+
+/*
+ * Ready in[] for a recvmmsg() of len byte packets, with the sender and
+ * where it was sent to if asked.  Both are value-result, so every time.
+ */
+void prepare(int len, int names)
+{
+	int i;
+
+	for (i = 0; i < BATCH; i++) {
+		struct msghdr *mh = &in[i].msg_hdr;
+
+		in_iov[i].iov_len = len;
+		mh->msg_name       = names ? &from[i] : NULL;
+		mh->msg_namelen    = names ? sizeof(from[i]) : 0;
+		mh->msg_control    = names ? ctl[i] : NULL;
+		mh->msg_controllen = names ? sizeof(ctl[i]) : 0;
+	}
+}
+
+/* Which of ours the packet in[i] was sent to, -1 if not */
+int dest_group(int i, int port)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(&in[i].msg_hdr); cm; cm = CMSG_NXTHDR(&in[i].msg_hdr, cm))
+		if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO)
+			return find_group(((struct in_pktinfo *)CMSG_DATA(cm))->ipi_addr.s_addr,
+					  htons(port));
+	return -1;
+}
+
+uint32_t msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Seen this payload for this group within the window?  If not, it is
+ * now.  The hash takes the payload eight bytes at a time; the low bits
+ * pick the bucket and the high 32 are what's kept.
+ */
+int duplicate(struct group *g, char *p, int len)
+{
+	struct seen *b, *old;
+	uint64_t h, w;
+	uint32_t tag;
+	int i;
+
+	h = mix(((uint64_t)g->addr.sin_addr.s_addr << 16 | g->addr.sin_port) ^ len);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ mix(w)) * 0x9e3779b97f4a7c15ULL;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	h = mix(h ^ w);
+
+	tag = h >> 32 | 1;
+	b = old = &cache[(h & cache_mask) * WAYS];
+	for (i = 0; i < WAYS; i++) {
+		if (b[i].tag == tag && now_ms - b[i].when < (uint32_t)window)
+			return 1;
+		if (!b[i].tag || now_ms - b[i].when > now_ms - old->when)
+			old = &b[i];
+		if (!old->tag)
+			break;
+	}
+	if (old->tag && now_ms - old->when < (uint32_t)window)
+		evicted++;
+	old->tag  = tag;
+	old->when = now_ms;
+	return 0;
+}
+
+/*
+ * Queue a packet, behind its tunnel header if it has one, for a site.
+ * It's copied, in[] is wanted for the next batch.
+ */
+void enqueue(struct dh *us, struct tunnel *t, char *p, int len)
+{
+	char *s;
+
+	if (us->tail - us->head == qsize) {
+		us->dropped++;
+		if (!drop_oldest)
+			return;
+		us->head++;
+	}
+	s = us->q + (us->tail++ & (qsize - 1)) * slotsize;
+	if (t) {
+		memcpy(s + sizeof(int), t, sizeof(*t));
+		memcpy(s + sizeof(int) + sizeof(*t), p, len);
+		len += sizeof(*t);
+	} else
+		memcpy(s + sizeof(int), p, len);
+	*(int *)s = len;
+}
+
+/*
+ * Send what a site's queue and tokens allow, a batch at a time, never
+ * waiting.  A full send buffer leaves the rest for EPOLLOUT.  Any other
+ * error is the site's, unreachable or refused: the packet at the head
+ * is counted and lost, and the relay carries on.
+ */
+void drain(struct dh *us)
+{
+	struct timespec now;
+	double budget;
+	char *s;
+	int n, k, i;
+
+	if (us->rate) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us->tokens += us->rate * 125.0 * (now.tv_sec - us->fill.tv_sec +
+						  (now.tv_nsec - us->fill.tv_nsec) / 1e9);
+		if (us->tokens > us->burst)
+			us->tokens = us->burst;
+		us->fill = now;
+	}
+	while (us->tail != us->head && !us->blocked) {
+		budget = us->tokens;
+		for (k = 0; k < BATCH && us->head + k != us->tail; k++) {
+			s = us->q + ((us->head + k) & (qsize - 1)) * slotsize;
+			if (us->rate && (budget -= *(int *)s) < 0)
+				break;
+			qiov[k].iov_base = s + sizeof(int);
+			qiov[k].iov_len  = *(int *)s;
+			qout[k].msg_hdr.msg_name    = &us->their_u_address;
+			qout[k].msg_hdr.msg_namelen = sizeof(us->their_u_address);
+			qout[k].msg_hdr.msg_iov    = &qiov[k];
+			qout[k].msg_hdr.msg_iovlen = 1;
+		}
+		if (!k)
+			return;		/* out of tokens */
+
+		n = sendmmsg(us->sockfd, qout, k, MSG_DONTWAIT);
+		send_calls++;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				us->blocked = 1;
+				site_events(us, 1);
+				return;
+			}
+			us->errors++;
+			us->head++;
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			us->tokens -= qiov[i].iov_len;
+		us->head += n;
+		us->sent += n;
+		m_out += n;
+	}
+}
+
+/*
+ * Wait for a site's socket to be writable only while it's blocked: a
+ * UDP socket that can be written to says so for every packet it frees,
+ * one wakeup per packet sent.
+ */
+void site_events(struct dh *us, int out)
+{
+	struct epoll_event ev;
+
+	ev.events   = EPOLLET | (unicast ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+	ev.data.u64 = EV_SITE | (uint64_t)(us - unicast_sites) << 32 | us->sockfd;
+	check(epoll_ctl(ep, EPOLL_CTL_MOD, us->sockfd, &ev));
+}
+
+/* Drain every site, and count those left waiting on their tokens */
+void drain_all(void)
+{
+	struct dh *us;
+	int udest;
+
+	throttled = 0;
+	for (udest = 0, us = unicast_sites; udest < nunicast_sites; udest++, us++) {
+		if (us->tail != us->head && !us->blocked)
+			drain(us);
+		if (us->tail != us->head && !us->blocked)
+			throttled++;
+	}
+}
+
+/*
+ * Multicast in, a copy of each packet queued for every unicast site,
+ * behind a tunnel header if we're tunnelling.
+ */
+void relay_multicast(int fd, int port)
+{
+	struct tunnel t;
+	struct dh *us;
+	int n, i, g, udest;
+
+	bzero(&t, sizeof(t));
+	t.version = TUNNEL_VERSION;
+	do {
+		prepare(bufsiz, 1);
+		n = recvmmsg(fd, in, BATCH, MSG_DONTWAIT, NULL);
+		recv_calls++;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			check(n);
+		}
+		m_in += n;
+		if (window)
+			now_ms = msec();
+
+		for (i = 0; i < n; i++) {
+			if ((g = dest_group(i, port)) < 0)
+				continue;
+			if (window && duplicate(&groups[g], in_iov[i].iov_base, in[i].msg_len)) {
+				m_dup++;
+				continue;
+			}
+			groups[g].in++;
+			t.port   = groups[g].addr.sin_port;
+			t.group  = groups[g].addr.sin_addr.s_addr;
+			t.source = from[i].sin_addr.s_addr;
+			for (udest = 0, us = unicast_sites; udest < nunicast_sites; udest++, us++)
+				enqueue(us, tunnel ? &t : NULL, in_iov[i].iov_base, in[i].msg_len);
+		}
+		drain_all();
+	} while (n == BATCH && !stop);	/* a short batch means it's drained */
+}
+
+/*
+ * Unicast in, multicast out: to the one group, or tunnelled, to the
+ * group in the header if it's one of ours.
+ */
+void relay_unicast(int fd)
+{
+	struct tunnel *t;
+	char *p;
+	int n, i, g, k, len;
+
+	do {
+		prepare(bufsiz + (tunnel ? sizeof(struct tunnel) : 0), 0);
+		n = recvmmsg(fd, in, BATCH, MSG_DONTWAIT, NULL);
+		recv_calls++;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			/* an ICMP error for what we sent the site, that's drain()'s */
+			if (errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+			    errno == ENETUNREACH) {
+				n = BATCH;
+				continue;
+			}
+			check(n);
+		}
+		u_in += n;
+		if (window)
+			now_ms = msec();
+
+		k = 0;
+		for (i = 0; i < n; i++) {
+			struct msghdr *mh = &out[k].msg_hdr;
+
+			p   = in_iov[i].iov_base;
+			len = in[i].msg_len;
+			g   = 0;
+			if (tunnel) {
+				t = (struct tunnel *)p;
+				if (len < (int)sizeof(*t) || t->version != TUNNEL_VERSION ||
+				    (g = find_group(t->group, t->port)) < 0) {
+					u_unknown++;
+					continue;
+				}
+				p   += sizeof(*t);
+				len -= sizeof(*t);
+			}
+			if (window && duplicate(&groups[g], p, len)) {
+				u_dup++;
+				continue;
+			}
+			groups[g].out++;
+			out_iov[k].iov_base = p;
+			out_iov[k].iov_len  = len;
+			mh->msg_name    = &groups[g].addr;
+			mh->msg_namelen = sizeof(groups[g].addr);
+			mh->msg_iov     = &out_iov[k];
+			mh->msg_iovlen  = 1;
+			k++;
+		}
+		u_out += sendv(m_fd, out, k);
+	} while (n == BATCH && !stop);
+}
+
+/*
+ * Rates since last time, system calls per packet relayed in, and the
+ * relay's capacity: packets in per second of CPU it used, what one
+ * core would do flat out.
+ */
+void stats(int final)
+{
+	static struct timespec last;
+	static unsigned long l_in, l_out, l_calls, l_dup, l_drop;
+	static double l_cpu;
+	struct timespec now;
+	struct rusage ru;
+	unsigned long pin, pout, calls, dropped = 0;
+	struct dh *us;
+	int udest;
+	double secs, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &ru);
+	if (!last.tv_sec && !last.tv_nsec)
+		last = started;
+
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	pin   = m_in + u_in - l_in;
+	pout  = m_out + u_out - l_out;
+	calls = recv_calls + send_calls + wait_calls - l_calls;
+	secs  = now.tv_sec - last.tv_sec + (now.tv_nsec - last.tv_nsec) / 1e9;
+	for (udest = 0, us = unicast_sites; udest < nunicast_sites; udest++, us++)
+		dropped += us->dropped;
+
+	if (final)
+		printf("Relayed %lu multicast to %lu unicast, %lu unicast to %lu multicast, %lu multicast send errors\n",
+		       m_in, m_out, u_in, u_out, u_errors);
+	if (final && tunnel)
+		printf("%d groups, %lu tunnelled packets for groups not ours dropped\n",
+		       ngroups, u_unknown);
+	if (final && window)
+		printf("Dropped %lu multicast and %lu unicast duplicates, %lu entries forgotten early%s\n",
+		       m_dup, u_dup, evicted, evicted ? ", try a bigger -C" : "");
+	for (udest = 0, us = unicast_sites; final && udest < nunicast_sites; udest++, us++)
+		printf("%s %d: sent %lu, %lu dropped from a full queue, %lu errors, %u still queued\n",
+		       us->host_name, us->port, us->sent, us->dropped, us->errors,
+		       us->tail - us->head);
+	if (secs > 0 && !final)
+		printf("in %.0f pps, out %.0f pps, %.2f syscalls/pkt, cpu %.0f%%, capacity %.0f pps, %lu dup, %lu queue drops\n",
+		       pin / secs, pout / secs, pin ? (double)calls / pin : 0.0,
+		       100 * (cpu - l_cpu) / secs, cpu > l_cpu ? pin / (cpu - l_cpu) : 0.0,
+		       m_dup + u_dup - l_dup, dropped - l_drop);
+	if (final) {
+		pin   = m_in + u_in;
+		calls = recv_calls + send_calls + wait_calls;
+		printf("%lu recvmmsg, %lu sendmmsg, %lu epoll_wait, %.2f syscalls/pkt, capacity %.0f pps\n",
+		       recv_calls, send_calls, wait_calls, pin ? (double)calls / pin : 0.0,
+		       cpu > 0 ? pin / cpu : 0.0);
+	}
+	fflush(stdout);
+
+	last = now;
+	l_in = m_in + u_in;
+	l_out = m_out + u_out;
+	l_calls = recv_calls + send_calls + wait_calls;
+	l_cpu = cpu;
+	l_dup = m_dup + u_dup;
+	l_drop = dropped;
 }
 
 void check(int n)
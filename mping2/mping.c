@@ -5,15 +5,24 @@
  * http://www.nmsl.cs.ucsb.edu/MulticastSocketsBook/
  */
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
 #include <net/if.h>             /* struct ifreq */
+#include <poll.h>
 #include <sys/ioctl.h>          /* SIOCGIFADDR */
 
 #include "mping.h"
 
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 struct response_buffer *resp_buf[RESPONSE_BUFFER_SIZE];
 int empty_location = 0;
 
@@ -42,14 +51,44 @@ int packets_rcvd = 0;
 double rtt_total = 0;
 double rtt_max = 0;
 double rtt_min = 999999999.0;
+double rtt_samples[MAX_SAMPLES];
+int num_samples = 0;
 
 /* default command-line arguments */
 char arg_mcaddr_str[16] = "239.255.255.1";
 int arg_mcport = 10000;
 unsigned char arg_ttl = 1;
+int arg_count = MAX_PINGS;
+int arg_busy_poll = 0;          /* busy poll receive */
+long arg_spin_budget = 0;       /* usec to spin before blocking, 0: forever */
 
 int verbose = 0;
 
+/**
+ * init_busy_poll() - Set up socket for low-latency receive
+ *
+ * Asks the kernel to poll the device queue on each receive attempt,
+ * instead of waiting for an interrupt and scheduler wakeup, and puts the
+ * socket in non-blocking mode so wait_packet() can spin on it.  Raising
+ * SO_BUSY_POLL above net.core.busy_read requires CAP_NET_ADMIN, so
+ * failures are only warned about.
+ */
+void init_busy_poll (void)
+{
+   int usec = BUSY_POLL_USEC, on = 1;
+
+   if (setsockopt (sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof (usec)) < 0)
+      perror ("Warning: setsockopt(SO_BUSY_POLL) failed");
+   if (setsockopt (sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof (on)) < 0 && verbose)
+      perror ("Warning: setsockopt(SO_PREFER_BUSY_POLL) failed");
+
+   if (fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK) < 0)
+   {
+      perror ("fcntl() failed");
+      exit (1);
+   }
+}
+
 void init_socket (void)
 {
    int flag_on = 1;
@@ -92,6 +131,9 @@ void init_socket (void)
       perror ("setsockopt() failed");
       exit (1);
    }
+
+   if (arg_busy_poll)
+      init_busy_poll ();
 }
 
 unsigned char *read_ip_address (char *iface, unsigned char *addr)
@@ -105,7 +147,8 @@ unsigned char *read_ip_address (char *iface, unsigned char *addr)
       return NULL;
    }
 
-   strncpy (ifr.ifr_name, iface, sizeof (ifr.ifr_name));
+   strncpy (ifr.ifr_name, iface, sizeof (ifr.ifr_name) - 1);
+   ifr.ifr_name[sizeof (ifr.ifr_name) - 1] = 0;
    ifr.ifr_addr.sa_family = AF_INET;
    if (-1 == ioctl (fd, SIOCGIFADDR, &ifr))
    {
@@ -120,6 +163,7 @@ unsigned char *read_ip_address (char *iface, unsigned char *addr)
    }
 
    close (fd);
+   errno = save_errno;
 
    return result;
 }
@@ -197,7 +241,8 @@ void get_local_host_info (char *iface)
 
 int usage (void)
 {
-   printf ("Usage: mping -r|-s [-v] [-i iface] [-a address] [-p port] [-t ttl]\n\n");
+   printf ("Usage: mping -r|-s [-v] [-i iface] [-a address] [-p port] [-t ttl]\n"
+           "                   [-c count] [-b budget]\n\n");
    printf ("-r|-s        Receiver or sender. Required argument, mutually \n");
    printf ("             exclusive\n");
    printf ("-i iface     Use iface for sending/receiving\n");
@@ -207,6 +252,9 @@ int usage (void)
    printf ("             the default of 10000.\n");
    printf ("-t ttl       Multicast time to live to send, overrides the\n");
    printf ("             default of 1.\n");
+   printf ("-c count     Number of pings to send, default %d.\n", MAX_PINGS);
+   printf ("-b budget    Busy poll receive, spin for budget usec before\n");
+   printf ("             blocking.  Zero spins forever.\n");
    printf ("-v           Verbose mode\n");
    printf ("-V           Display version\n");
    
@@ -225,7 +273,7 @@ int main (int argc, char **argv)
    char *iface = NULL;
 
    /* parse command-line arguments */
-   while ((c = getopt (argc, argv, "vVrsa:p:t:i:")) != -1)
+   while ((c = getopt (argc, argv, "vVrsa:b:c:p:t:i:")) != -1)
    {
       switch (c)
       {
@@ -248,6 +296,17 @@ int main (int argc, char **argv)
             strcpy (arg_mcaddr_str, optarg);
             break;
 
+         case 'b':
+            /* busy poll, with spin budget in usec */
+            arg_busy_poll = 1;
+            arg_spin_budget = atol (optarg);
+            break;
+
+         case 'c':
+            /* number of pings */
+            arg_count = atoi (optarg);
+            break;
+
          case 'p':
             /* mping port override */
             arg_mcport = atoi (optarg);
@@ -260,7 +319,8 @@ int main (int argc, char **argv)
 
          case 'i':
             /* use interface instead of default from hostname */
-            strncpy (ifname, optarg, strlen (ifname));
+            strncpy (ifname, optarg, sizeof (ifname) - 1);
+            ifname[sizeof (ifname) - 1] = 0;
             iface = ifname;
             break;
 
@@ -321,7 +381,7 @@ void send_mping (int signo __attribute__ ((unused)))
    struct timeval now;
 
    /* increment count, check if done */
-   if (current_ping++ >= MAX_PINGS)
+   if (current_ping++ >= arg_count)
    {
       /* set another alarm call to exit in 5 second */
       signal (SIGALRM, clean_exit);
@@ -371,6 +431,50 @@ void send_packet (struct mping_struct *packet)
    packets_sent++;
 }
 
+/**
+ * wait_packet() - Receive next packet, blocking or busy polling
+ * @buf: Receive buffer
+ * @len: Size of @buf
+ *
+ * In busy poll mode the non-blocking socket is polled in a tight loop
+ * for up to arg_spin_budget usec, zero meaning forever, before falling
+ * back to sleeping in poll().  Signals, e.g. the send alarm, interrupt
+ * the wait with EINTR as for a blocking recvfrom().
+ */
+ssize_t wait_packet (char *buf, size_t len)
+{
+   struct timeval start, now;
+   struct pollfd pfd;
+   ssize_t recv_len;
+
+   if (!arg_busy_poll)
+      return recvfrom (sock, buf, len, 0, NULL, 0);
+
+   gettimeofday (&start, NULL);
+   while (1)
+   {
+      recv_len = recvfrom (sock, buf, len, MSG_DONTWAIT, NULL, 0);
+      if (recv_len >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+         return recv_len;
+
+      if (arg_spin_budget)
+      {
+         gettimeofday (&now, NULL);
+         subtract_timeval (&now, &start);
+         if (now.tv_sec * 1000000L + now.tv_usec >= arg_spin_budget)
+            break;
+      }
+   }
+
+   /* spin budget exhausted, sleep until there is something to read */
+   pfd.fd = sock;
+   pfd.events = POLLIN;
+   if (poll (&pfd, 1, -1) < 0)
+      return -1;
+
+   return recvfrom (sock, buf, len, MSG_DONTWAIT, NULL, 0);
+}
+
 void sender_listen_loop ()
 {
    char recv_packet[MAX_BUF_LEN + 1];   /* buffer to receive packet */
@@ -384,9 +488,9 @@ void sender_listen_loop ()
       memset (recv_packet, 0, sizeof (recv_packet));
 
       /* block waiting to receive a packet */
-      if ((recv_len = recvfrom (sock, recv_packet, MAX_BUF_LEN, 0, NULL, 0)) < 0)
+      if ((recv_len = wait_packet (recv_packet, MAX_BUF_LEN)) < 0)
       {
-         if (errno == EINTR)
+         if (errno == EINTR || errno == EAGAIN)
          {
             /* interrupt is ok */
             continue;
@@ -421,6 +525,8 @@ void sender_listen_loop ()
             rtt_max = actual_rtt;
          if (actual_rtt < rtt_min)
             rtt_min = actual_rtt;
+         if (num_samples < MAX_SAMPLES)
+            rtt_samples[num_samples++] = actual_rtt;
 
          /* output received packet information */
          printf ("%zu bytes from %s: seqno=%d ttl=%d ",
@@ -448,9 +554,9 @@ void receiver_listen_loop ()
       memset (recv_packet, 0, sizeof (recv_packet));
 
       /* block waiting to receive a packet */
-      if ((recv_len = recvfrom (sock, recv_packet, MAX_BUF_LEN, 0, NULL, 0)) < 0)
+      if ((recv_len = wait_packet (recv_packet, MAX_BUF_LEN)) < 0)
       {
-         if (errno == EINTR)
+         if (errno == EINTR || errno == EAGAIN)
          {
             /* interrupt is ok */
             continue;
@@ -678,9 +784,38 @@ void clean_exit ()
    else
       printf ("round-trip min/avg/max = %.3f/%.3f/%.3f ms\n",
               rtt_min, (rtt_total / packets_rcvd), rtt_max);
+   output_distribution ();
    exit (0);
 }
 
+static int cmp_double (const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+/* Percentiles of actual rtt, compare runs with and without -b */
+void output_distribution ()
+{
+   const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+   size_t i;
+
+   if (num_samples == 0)
+      return;
+
+   qsort (rtt_samples, num_samples, sizeof (double), cmp_double);
+
+   if (arg_busy_poll)
+      printf ("rtt distribution, busy poll %d usec, spin budget %ld usec:\n",
+              BUSY_POLL_USEC, arg_spin_budget);
+   else
+      printf ("rtt distribution, blocking receive:\n");
+   for (i = 0; i < sizeof (pct) / sizeof (pct[0]); i++)
+      printf ("  p%-5g %.3f ms\n", pct[i],
+              rtt_samples[(int)((num_samples - 1) * pct[i] / 100.0 + 0.5)]);
+}
+
 double send_interval ()
 {
    double interval;
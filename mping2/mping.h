@@ -21,6 +21,8 @@
 #define MAX_BUF_LEN      1024    /* size of receive buffer */
 #define MAX_HOSTNAME_LEN  256    /* size of host name buffer */
 #define MAX_PINGS           5    /* number of pings to send */
+#define MAX_SAMPLES     65536    /* rtt samples kept for percentiles */
+#define BUSY_POLL_USEC     50    /* SO_BUSY_POLL, device poll per recv */
 
 #define VERSION_MAJOR 1          /* mping version major */
 #define VERSION_MINOR 2          /* mping version minor */
@@ -55,6 +57,8 @@ struct response_buffer
 /* function prototypes */
 void send_mping ();
 void send_packet (struct mping_struct *packet);
+void init_busy_poll (void);
+ssize_t wait_packet (char *buf, size_t len);
 void sender_listen_loop ();
 void receiver_listen_loop ();
 void subtract_timeval (struct timeval *val, const struct timeval *sub);
@@ -62,6 +66,7 @@ double timeval_to_ms (const struct timeval *val);
 int process_mping_packet (char *packet, size_t recv_len, unsigned char type);
 void clean_exit ();
 void output_results ();
+void output_distribution ();
 void received_packet_count ();
 void check_send (int);
 double send_interval ();
@@ -13,24 +13,705 @@
 
 #define MULTICAST
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <net/if.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netpacket/packet.h>
 
-int main (int argc, char *argv[])
+#define LATMAX 10000            /* usec, latency histogram range */
+
+/*
+ * Batch mode.  A command file, same commands as interactive mode, is
+ * parsed up front into an array of operations, which are then run
+ * back-to-back or paced, with the time of each system call recorded
+ * in a latency histogram per operation type.
+ */
+enum { OP_JOIN, OP_LEAVE, OP_ADD, OP_DEL, OP_ALLMULTI, OP_PROMISC, OP_MAX };
+
+static const char *opname[OP_MAX] = {
+   "join", "leave", "addmulti", "delmulti", "allmulti", "promisc"
+};
+
+/* What interactive mode says about each, errno tells why it failed */
+static const char *opfail[OP_MAX] = {
+   "can't join group", "can't leave group", "can't add ether adress",
+   "can't delete ether adress", "can't set allmulti", "can't set promisc"
+};
+
+static const char *opdone[OP_MAX] = {
+   "group joined", "group left", "ether address added", "ether address deleted"
+};
+
+struct op
 {
-   int so;
-   char line[80];
-   char *lineptr;
+   int type;
+   int line;
    struct ip_mreq imr;
    struct ifreq ifr;
-   int n, f;
+   unsigned flag;
+   short was;                   /* Interface flags before a set */
+};
+
+/* Latency histogram, one bucket per usec, last is overflow */
+struct histogram
+{
+   unsigned long bucket[LATMAX + 1];
+   unsigned long count;
+   unsigned long failed;
+   int first_line;              /* First failure */
+   int first_errno;
+   unsigned long long max;
+};
+
+static int parse_op (char *lineptr, struct op *op)
+{
    unsigned i1, i2, i3, i4, g1, g2, g3, g4;
    unsigned e1, e2, e3, e4, e5, e6;
+   char cmd;
+
+   while (*lineptr == ' ' || *lineptr == '\t')
+      ++lineptr;
+   cmd = *lineptr++;
+   while (*lineptr == ' ' || *lineptr == '\t')
+      ++lineptr;
+
+   memset (op, 0, sizeof (*op));
+   switch (cmd)
+   {
+      case 'j':
+      case 'l':
+         if (sscanf (lineptr, "%u.%u.%u.%u %u.%u.%u.%u",
+                     &g1, &g2, &g3, &g4, &i1, &i2, &i3, &i4) != 8)
+            return -1;
+         op->type = cmd == 'j' ? OP_JOIN : OP_LEAVE;
+         op->imr.imr_multiaddr.s_addr = htonl ((g1 << 24) | (g2 << 16) | (g3 << 8) | g4);
+         op->imr.imr_interface.s_addr = htonl ((i1 << 24) | (i2 << 16) | (i3 << 8) | i4);
+         return 0;
+
+      case 'a':
+      case 'd':
+         if (sscanf (lineptr, "%15s %x.%x.%x.%x.%x.%x",
+                     op->ifr.ifr_name, &e1, &e2, &e3, &e4, &e5, &e6) != 7)
+            return -1;
+         op->type = cmd == 'a' ? OP_ADD : OP_DEL;
+         op->ifr.ifr_addr.sa_family = AF_UNSPEC;
+         op->ifr.ifr_addr.sa_data[0] = e1;
+         op->ifr.ifr_addr.sa_data[1] = e2;
+         op->ifr.ifr_addr.sa_data[2] = e3;
+         op->ifr.ifr_addr.sa_data[3] = e4;
+         op->ifr.ifr_addr.sa_data[4] = e5;
+         op->ifr.ifr_addr.sa_data[5] = e6;
+         return 0;
+
+      case 'm':
+      case 'p':
+         if (sscanf (lineptr, "%15s %u", op->ifr.ifr_name, &op->flag) != 2)
+            return -1;
+         op->type = cmd == 'm' ? OP_ALLMULTI : OP_PROMISC;
+         return 0;
+
+      case '#':
+      case '\n':
+      case 0:
+         return 1;              /* Comment or empty line */
+   }
+
+   return -1;
+}
+
+static int run_op (int so, struct op *op)
+{
+   short bit = op->type == OP_ALLMULTI ? IFF_ALLMULTI : IFF_PROMISC;
+
+   switch (op->type)
+   {
+      case OP_JOIN:
+         return setsockopt (so, IPPROTO_IP, IP_ADD_MEMBERSHIP, &op->imr, sizeof (op->imr));
+
+      case OP_LEAVE:
+         return setsockopt (so, IPPROTO_IP, IP_DROP_MEMBERSHIP, &op->imr, sizeof (op->imr));
+
+      case OP_ADD:
+         return ioctl (so, SIOCADDMULTI, &op->ifr);
+
+      case OP_DEL:
+         return ioctl (so, SIOCDELMULTI, &op->ifr);
+   }
+
+   /* -2 tells a failed read of the flags from a failed write */
+   if (ioctl (so, SIOCGIFFLAGS, &op->ifr) == -1)
+      return -2;
+   op->was = op->ifr.ifr_flags;
+   if (op->flag)
+      op->ifr.ifr_flags |= bit;
+   else
+      op->ifr.ifr_flags &= ~bit;
+
+   return ioctl (so, SIOCSIFFLAGS, &op->ifr);
+}
+
+static unsigned long long now_ns (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_add (struct histogram *h, unsigned long long nsec)
+{
+   unsigned long long usec = nsec / 1000;
+
+   h->bucket[usec < LATMAX ? usec : LATMAX]++;
+   h->count++;
+   if (usec > h->max)
+      h->max = usec;
+}
+
+static void hist_print (const char *name, struct histogram *h)
+{
+   const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+   unsigned long sum = 0;
+   size_t i, j;
+
+   printf ("%-10s %9lu %7lu", name, h->count, h->failed);
+   for (i = 0, j = 0; j < sizeof (pct) / sizeof (pct[0]); j++)
+   {
+      while (i < LATMAX && (sum + h->bucket[i]) * 100.0 < pct[j] * h->count)
+         sum += h->bucket[i++];
+      printf (" %s%6zu", i == LATMAX ? ">" : " ", i);
+   }
+   printf ("  %7llu\n", h->max);
+}
+
+static int load (const char *file, struct op **ops)
+{
+   char line[128];
+   int num = 0, size = 0, lineno = 0, rc;
+   struct op op, *tmp;
+   FILE *fp;
+
+   fp = fopen (file, "r");
+   if (!fp)
+   {
+      perror ("can't open command file");
+      return -1;
+   }
+
+   while (fgets (line, sizeof (line), fp) != NULL)
+   {
+      lineno++;
+      rc = parse_op (line, &op);
+      if (rc > 0)
+         continue;
+      if (rc < 0)
+      {
+         fprintf (stderr, "%s:%d: bad command: %s", file, lineno, line);
+         fclose (fp);
+         return -1;
+      }
+
+      if (num == size)
+      {
+         size = size ? size * 2 : 1024;
+         tmp = realloc (*ops, size * sizeof (struct op));
+         if (!tmp)
+         {
+            perror ("can't allocate operations");
+            fclose (fp);
+            return -1;
+         }
+         *ops = tmp;
+      }
+      op.line = lineno;
+      (*ops)[num++] = op;
+   }
+   fclose (fp);
+
+   return num;
+}
+
+static int batch (int so, const char *file, double rate, int repeat)
+{
+   struct histogram *hist;
+   struct op *ops = NULL;
+   unsigned long long start, next, t, total = 0, failed = 0;
+   double elapsed;
+   int num, i, r;
+
+   num = load (file, &ops);
+   if (num <= 0)
+      return num < 0;
+
+   hist = calloc (OP_MAX, sizeof (struct histogram));
+   if (!hist)
+   {
+      perror ("can't allocate histograms");
+      return 1;
+   }
+
+   printf ("Running %d operations from %s %d time(s), %s\n", num, file, repeat,
+           rate > 0 ? "paced" : "back-to-back");
+   fflush (stdout);
+
+   start = next = now_ns ();
+   for (r = 0; r < repeat; r++)
+   {
+      for (i = 0; i < num; i++)
+      {
+         struct histogram *h = &hist[ops[i].type];
+
+         if (rate > 0)
+         {
+            struct timespec ts = { next / 1000000000ULL, next % 1000000000ULL };
+
+            clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            next += 1e9 / rate;
+         }
+
+         t = now_ns ();
+         if (run_op (so, &ops[i]))
+         {
+            if (!h->failed++)
+            {
+               h->first_line = ops[i].line;
+               h->first_errno = errno;
+            }
+            failed++;
+         }
+         hist_add (h, now_ns () - t);
+         total++;
+      }
+   }
+   elapsed = (now_ns () - start) / 1e9;
+
+   printf ("Ran %llu operations in %.3f sec, %.0f ops/sec, %llu failed\n",
+           total, elapsed, elapsed > 0 ? total / elapsed : 0.0, failed);
+   printf ("%-10s %9s %7s %7s %7s %7s %7s  %7s\n", "Operation", "Count", "Failed",
+           "p50", "p90", "p99", "p99.9", "Max usec");
+   for (i = 0; i < OP_MAX; i++)
+   {
+      if (hist[i].count)
+         hist_print (opname[i], &hist[i]);
+   }
+   for (i = 0; i < OP_MAX; i++)
+   {
+      if (hist[i].failed)
+         printf ("%s: first failure at line %d: %s\n", opname[i],
+                 hist[i].first_line, strerror (hist[i].first_errno));
+   }
+
+   free (hist);
+   free (ops);
+
+   return failed ? 1 : 0;
+}
+
+/*
+ * Filter capacity benchmark.  Ethernet multicast addresses are added to
+ * the interface under test one step at a time, while a generator on a
+ * peer interface wired to it sends to addresses nobody subscribed to.
+ * Once the NIC runs out of exact match filter slots it falls back to a
+ * hash filter, or to receiving all multicast, and the unwanted frames
+ * start reaching the host.  They are counted on a packet socket, which
+ * only sees what the NIC lets through.  The ALLMULTI and PROMISC flags
+ * are watched too, but a driver fallback done in hardware does not show
+ * up there, so the frame count is what decides.
+ */
+#define FILT_ADDED     0x010000 /* Low 23 bits of added MACs */
+#define FILT_UNWANTED  0x7f0000 /* Low 23 bits of generator MACs */
+#define FILT_ETHERTYPE 0x88b5   /* Local experimental, dropped by the stack */
+
+struct filter
+{
+   const char *iface;
+   const char *peer;
+   int max;                     /* Addresses to add */
+   int step;                    /* Addresses added per measurement */
+   int dwell;                   /* msec, measurement window */
+   int unwanted;                /* Destinations cycled by the generator */
+   double rate;                 /* Generator frames/sec */
+};
+
+static volatile sig_atomic_t filter_stop;
+
+static void filter_signal (int signo)
+{
+   (void)signo;
+   filter_stop = 1;
+}
+
+static void filter_mac (unsigned char *mac, unsigned low)
+{
+   mac[0] = 0x01;
+   mac[1] = 0x00;
+   mac[2] = 0x5e;
+   mac[3] = (low >> 16) & 0x7f;
+   mac[4] = (low >> 8) & 0xff;
+   mac[5] = low & 0xff;
+}
+
+static int filter_addr (int so, const char *iface, int num, unsigned long req)
+{
+   struct ifreq ifr;
+
+   memset (&ifr, 0, sizeof (ifr));
+   strncpy (ifr.ifr_name, iface, IFNAMSIZ - 1);
+   ifr.ifr_addr.sa_family = AF_UNSPEC;
+   filter_mac ((unsigned char *)ifr.ifr_addr.sa_data, FILT_ADDED + num);
+
+   return ioctl (so, req, &ifr);
+}
+
+static int filter_flags (int so, const char *iface)
+{
+   struct ifreq ifr;
+
+   memset (&ifr, 0, sizeof (ifr));
+   strncpy (ifr.ifr_name, iface, IFNAMSIZ - 1);
+   if (ioctl (so, SIOCGIFFLAGS, &ifr))
+      return -1;
+
+   return ifr.ifr_flags & (IFF_ALLMULTI | IFF_PROMISC);
+}
+
+static const char *filter_flagstr (int flags)
+{
+   if (flags < 0)
+      return "?";
+   if (flags & IFF_PROMISC)
+      return flags & IFF_ALLMULTI ? "promisc,allmulti" : "promisc";
+
+   return flags & IFF_ALLMULTI ? "allmulti" : "-";
+}
+
+/* Driver receive multicast counter, not all drivers keep it */
+static long long filter_stat (const char *iface, const char *name)
+{
+   char path[128];
+   long long val = -1;
+   FILE *fp;
+
+   snprintf (path, sizeof (path), "/sys/class/net/%s/statistics/%s", iface, name);
+   fp = fopen (path, "r");
+   if (!fp)
+      return -1;
+   if (fscanf (fp, "%lld", &val) != 1)
+      val = -1;
+   fclose (fp);
+
+   return val;
+}
+
+static int filter_socket (const char *iface)
+{
+   struct sockaddr_ll sll;
+   int sd;
+
+   memset (&sll, 0, sizeof (sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons (FILT_ETHERTYPE);
+   sll.sll_ifindex = if_nametoindex (iface);
+   if (!sll.sll_ifindex)
+   {
+      fprintf (stderr, "no such interface: %s\n", iface);
+      return -1;
+   }
+
+   sd = socket (AF_PACKET, SOCK_RAW, htons (FILT_ETHERTYPE));
+   if (sd == -1)
+   {
+      perror ("can't open packet socket");
+      return -1;
+   }
+   if (bind (sd, (struct sockaddr *)&sll, sizeof (sll)))
+   {
+      perror ("can't bind packet socket");
+      close (sd);
+      return -1;
+   }
+
+   return sd;
+}
+
+/* Runs in a child process until killed */
+static void filter_generate (struct filter *f)
+{
+   unsigned char frame[64];
+   unsigned long long next;
+   int sd, i = 0;
+
+   prctl (PR_SET_PDEATHSIG, SIGTERM);
+   sd = filter_socket (f->peer);
+   if (sd == -1)
+      _exit (1);
+
+   memset (frame, 0, sizeof (frame));
+   frame[6] = 0x02;             /* Locally administered source */
+   frame[11] = 0x01;
+   frame[12] = FILT_ETHERTYPE >> 8;
+   frame[13] = FILT_ETHERTYPE & 0xff;
+
+   next = now_ns ();
+   while (1)
+   {
+      struct timespec ts = { next / 1000000000ULL, next % 1000000000ULL };
+
+      filter_mac (frame, FILT_UNWANTED + i);
+      if (++i == f->unwanted)
+         i = 0;
+      /* A full device queue only drops this frame, anything else is fatal */
+      if (send (sd, frame, sizeof (frame), 0) == -1 && errno != ENOBUFS)
+      {
+         perror ("generator can't send");
+         _exit (1);
+      }
+
+      next += 1e9 / f->rate;
+      clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+   }
+}
+
+/* Count generator frames let through by the NIC during one window */
+static unsigned long filter_count (int sd, int dwell)
+{
+   unsigned long long end = now_ns () + dwell * 1000000ULL, now;
+   unsigned char buf[128];
+   unsigned long count = 0;
+   struct pollfd pfd = { sd, POLLIN, 0 };
+
+   while ((now = now_ns ()) < end && !filter_stop)
+   {
+      if (poll (&pfd, 1, (end - now) / 1000000 + 1) <= 0)
+         continue;
+      while (recv (sd, buf, sizeof (buf), MSG_DONTWAIT) > 0)
+         count++;
+   }
+
+   return count;
+}
+
+static int filter_bench (int so, struct filter *f)
+{
+   unsigned char buf[128];
+   unsigned long leaked, expect;
+   long long rx0, rx, tx0, tx;
+   int sd, n, added = 0, err = 0, flags, last = -2, clean = -1, leak = -1, total;
+   int dead = 0, st = 0;
+   pid_t pid;
+
+   sd = filter_socket (f->iface);
+   if (sd == -1)
+      return 1;
+
+   flags = filter_flags (so, f->iface);
+   if (flags > 0)
+      printf ("Warning: %s is already %s, nothing will be filtered\n",
+              f->iface, filter_flagstr (flags));
+
+   pid = fork ();
+   if (pid == -1)
+   {
+      perror ("can't start generator");
+      return 1;
+   }
+   if (!pid)
+      filter_generate (f);
+
+   signal (SIGINT, filter_signal);
+   signal (SIGTERM, filter_signal);
+
+   expect = f->rate * f->dwell / 1000;
+   printf ("Filter capacity on %s, generator on %s sending %.0f frames/sec to %d unwanted groups\n",
+           f->iface, f->peer, f->rate, f->unwanted);
+   printf ("%8s %10s %6s %10s  %s\n", "Addrs", "Unwanted", "%", "RxMcast", "Flags");
+   fflush (stdout);
+
+   /* Let the generator get going before the baseline, and make sure it does */
+   tx0 = filter_stat (f->peer, "tx_packets");
+   filter_count (sd, f->dwell);
+   tx = filter_stat (f->peer, "tx_packets");
+   if (waitpid (pid, &st, WNOHANG) == pid)
+      dead = 1;
+   else if (tx0 >= 0 && tx >= 0 && tx == tx0)
+      dead = 2;
+
+   for (n = 0; n <= f->max && !filter_stop && !dead; n += f->step)
+   {
+      for (; added < n; added++)
+      {
+         if (filter_addr (so, f->iface, added, SIOCADDMULTI))
+         {
+            err = errno;
+            break;
+         }
+      }
+      if (err)
+         break;
+
+      /* Frames queued before the filter changed don't count */
+      while (recv (sd, buf, sizeof (buf), MSG_DONTWAIT) > 0)
+         ;
+
+      rx0 = filter_stat (f->iface, "multicast");
+      leaked = filter_count (sd, f->dwell);
+      rx = filter_stat (f->iface, "multicast");
+      flags = filter_flags (so, f->iface);
+      if (filter_stop)
+         break;
+
+      /* A clean window means nothing if nobody was sending */
+      if (waitpid (pid, &st, WNOHANG) == pid)
+      {
+         dead = 1;
+         break;
+      }
+
+      if (!n || !(n & (n - 1)) || flags != last || (leaked && leak < 0))
+      {
+         printf ("%8d %10lu %6.1f %10lld  %s\n", n, leaked,
+                 expect ? 100.0 * leaked / expect : 0.0,
+                 rx0 >= 0 && rx >= 0 ? rx - rx0 : -1, filter_flagstr (flags));
+         fflush (stdout);
+      }
+      last = flags;
+
+      if (leaked)
+      {
+         leak = n;
+         break;
+      }
+      clean = n;
+   }
+
+   if (dead != 1)
+   {
+      kill (pid, SIGTERM);
+      waitpid (pid, NULL, 0);
+   }
+
+   total = added;
+   while (added-- > 0)
+      filter_addr (so, f->iface, added, SIOCDELMULTI);
+   close (sd);
+
+   if (filter_stop)
+   {
+      printf ("Interrupted\n");
+      return 1;
+   }
+   if (dead == 1)
+   {
+      printf ("Generator on %s died (%s %d), no result\n", f->peer,
+              WIFSIGNALED (st) ? "signal" : "exit code",
+              WIFSIGNALED (st) ? WTERMSIG (st) : WEXITSTATUS (st));
+      return 1;
+   }
+   if (dead == 2)
+   {
+      printf ("No frames left %s during the baseline, no result\n", f->peer);
+      return 1;
+   }
+   if (err)
+      printf ("SIOCADDMULTI failed after %d addresses: %s\n", total, strerror (err));
+   if (leak == 0)
+      printf ("%s lets unwanted multicast through with no addresses added, it does not filter\n", f->iface);
+   else if (leak > 0)
+      printf ("Filter holds %d addresses, unwanted traffic reaches the host at %d\n", clean, leak);
+   else if (!err)
+      printf ("No unwanted traffic reached the host with %d addresses\n", clean);
+
+   return 0;
+}
+
+int main (int argc, char *argv[])
+{
+   int so;
+   char line[80];
+   char *lineptr;
+   struct op op;
+   int rc, c, repeat = 1;
+   char *file = NULL;
+   double rate = 0;
+   struct filter filt = { NULL, NULL, 4096, 1, 50, 1024, 0 };
+
+   while ((c = getopt (argc, argv, "b:c:F:g:n:r:s:u:w:h")) != -1)
+   {
+      switch (c)
+      {
+         case 'b':
+            file = optarg;
+            break;
+
+         case 'c':
+            repeat = atoi (optarg);
+            break;
+
+         case 'F':
+            filt.iface = optarg;
+            break;
+
+         case 'g':
+            filt.peer = optarg;
+            break;
+
+         case 'n':
+            filt.max = atoi (optarg);
+            break;
+
+         case 'r':
+            rate = atof (optarg);
+            break;
+
+         case 's':
+            filt.step = atoi (optarg);
+            break;
+
+         case 'u':
+            filt.unwanted = atoi (optarg);
+            break;
+
+         case 'w':
+            filt.dwell = atoi (optarg);
+            break;
+
+         default:
+            fprintf (stderr, "usage: %s [-b file [-c count] [-r rate]]\n"
+                     "       %s -F ifname -g peer [-n max] [-s step] [-w msec] [-u num] [-r rate]\n"
+                     "  -b file   run commands from file as a timed batch\n"
+                     "  -c count  run the batch count times\n"
+                     "  -r rate   operations per second, default back-to-back,\n"
+                     "            or generator frames per second, default 10000\n"
+                     "  -F ifname measure the multicast MAC filter capacity of ifname\n"
+                     "  -g peer   interface wired to ifname to send unwanted frames on\n"
+                     "  -n max    most addresses to add, default 4096\n"
+                     "  -s step   addresses added per measurement, default 1\n"
+                     "  -w msec   measurement window, default 50\n"
+                     "  -u num    unwanted destinations to cycle through, default 1024\n",
+                     argv[0], argv[0]);
+            exit (1);
+      }
+   }
+
+   if (filt.iface && (!filt.peer || filt.max < 1 || filt.step < 1 || filt.dwell < 1 ||
+                      filt.unwanted < 1 || filt.unwanted > 0xffff || filt.max > 0x6effff))
+   {
+      fprintf (stderr, "-F needs a peer interface, -g, and sane -n/-s/-w/-u\n");
+      exit (1);
+   }
 
    if ((so = socket (AF_INET, SOCK_DGRAM, 0)) == -1)
    {
@@ -38,6 +719,15 @@ int main (int argc, char *argv[])
       exit (1);
    }
 
+   if (file)
+      return batch (so, file, rate, repeat);
+
+   if (filt.iface)
+   {
+      filt.rate = rate > 0 ? rate : 10000;
+      return filter_bench (so, &filt);
+   }
+
    printf ("multicast membership test program; ");
    printf ("enter ? for list of commands\n");
 
@@ -58,157 +748,30 @@ int main (int argc, char *argv[])
                     " m ifname 1/0           - set/clear ether allmulti flag \n",
                     " p ifname 1/0           - set/clear ether promisc flag  \n",
                     " q                      - quit                          \n\n");
-            break;
-
-         case 'j':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%u.%u.%u.%u %u.%u.%u.%u %u",
-                             &g1, &g2, &g3, &g4, &i1, &i2, &i3, &i4)) != 8)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            imr.imr_multiaddr.s_addr = (g1 << 24) | (g2 << 16) | (g3 << 8) | g4;
-            imr.imr_multiaddr.s_addr = htonl (imr.imr_multiaddr.s_addr);
-            imr.imr_interface.s_addr = (i1 << 24) | (i2 << 16) | (i3 << 8) | i4;
-            imr.imr_interface.s_addr = htonl (imr.imr_interface.s_addr);
-            if (setsockopt (so, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-                            &imr, sizeof (struct ip_mreq)) == -1)
-               perror ("can't join group");
-            else
-               printf ("group joined\n");
-            break;
-
-         case 'l':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%u.%u.%u.%u %u.%u.%u.%u %u",
-                             &g1, &g2, &g3, &g4, &i1, &i2, &i3, &i4)) != 8)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            imr.imr_multiaddr.s_addr = (g1 << 24) | (g2 << 16) | (g3 << 8) | g4;
-            imr.imr_multiaddr.s_addr = htonl (imr.imr_multiaddr.s_addr);
-            imr.imr_interface.s_addr = (i1 << 24) | (i2 << 16) | (i3 << 8) | i4;
-            imr.imr_interface.s_addr = htonl (imr.imr_interface.s_addr);
-            if (setsockopt (so, IPPROTO_IP, IP_DROP_MEMBERSHIP,
-                            &imr, sizeof (struct ip_mreq)) == -1)
-               perror ("can't leave group");
-            else
-               printf ("group left\n");
-            break;
-
-         case 'a':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%s %x.%x.%x.%x.%x.%x",
-                             ifr.ifr_name, &e1, &e2, &e3, &e4, &e5, &e6)) != 7)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            ifr.ifr_addr.sa_family = AF_UNSPEC;
-            ifr.ifr_addr.sa_data[0] = e1;
-            ifr.ifr_addr.sa_data[1] = e2;
-            ifr.ifr_addr.sa_data[2] = e3;
-            ifr.ifr_addr.sa_data[3] = e4;
-            ifr.ifr_addr.sa_data[4] = e5;
-            ifr.ifr_addr.sa_data[5] = e6;
-            if (ioctl (so, SIOCADDMULTI, &ifr) == -1)
-               perror ("can't add ether adress");
-            else
-               printf ("ether address added\n");
-            break;
-
-         case 'd':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%s %x.%x.%x.%x.%x.%x",
-                             ifr.ifr_name, &e1, &e2, &e3, &e4, &e5, &e6)) != 7)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            ifr.ifr_addr.sa_family = AF_UNSPEC;
-            ifr.ifr_addr.sa_data[0] = e1;
-            ifr.ifr_addr.sa_data[1] = e2;
-            ifr.ifr_addr.sa_data[2] = e3;
-            ifr.ifr_addr.sa_data[3] = e4;
-            ifr.ifr_addr.sa_data[4] = e5;
-            ifr.ifr_addr.sa_data[5] = e6;
-            if (ioctl (so, SIOCDELMULTI, &ifr) == -1)
-               perror ("can't delete ether adress");
-            else
-               printf ("ether address deleted\n");
-            break;
-
-         case 'm':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%s %u", ifr.ifr_name, &f)) != 2)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            if (ioctl (so, SIOCGIFFLAGS, &ifr) == -1)
-            {
-               perror ("can't get interface flags");
-               break;
-            }
-            printf ("interface flags %x, ", ifr.ifr_flags);
-            fflush (stdout);
-            if (f)
-               ifr.ifr_flags |= IFF_ALLMULTI;
-            else
-               ifr.ifr_flags &= ~IFF_ALLMULTI;
-            if (ioctl (so, SIOCSIFFLAGS, &ifr) == -1)
-               perror ("can't set");
-            else
-               printf ("changed to %x\n", ifr.ifr_flags);
-            break;
-
-         case 'p':
-            ++lineptr;
-            while (*lineptr == ' ' || *lineptr == '\t')
-               ++lineptr;
-            if ((n = sscanf (lineptr, "%s %u", ifr.ifr_name, &f)) != 2)
-            {
-               printf ("bad args\n");
-               break;
-            }
-            if (ioctl (so, SIOCGIFFLAGS, &ifr) == -1)
-            {
-               perror ("can't get interface flags");
-               break;
-            }
-            printf ("interface flags %x, ", ifr.ifr_flags);
-            fflush (stdout);
-            if (f)
-               ifr.ifr_flags |= IFF_PROMISC;
-            else
-               ifr.ifr_flags &= ~IFF_PROMISC;
-            if (ioctl (so, SIOCSIFFLAGS, &ifr) == -1)
-               perror ("can't set");
-            else
-               printf ("changed to %x\n", ifr.ifr_flags);
-            break;
+            continue;
 
          case 'q':
             exit (0);
+      }
 
-         case '\n':
-            break;
-
-         default:
-            printf ("bad command\n");
-            break;
+      /* Same parser, and the same bounds, as batch mode */
+      rc = parse_op (lineptr, &op);
+      if (rc > 0)
+         continue;
+      if (rc < 0)
+      {
+         printf (*lineptr && strchr ("jladmp", *lineptr) ? "bad args\n" : "bad command\n");
+         continue;
       }
+
+      rc = run_op (so, &op);
+      if (rc == -2)
+         perror ("can't get interface flags");
+      else if (rc == -1)
+         perror (opfail[op.type]);
+      else if (op.type == OP_ALLMULTI || op.type == OP_PROMISC)
+         printf ("interface flags %x, changed to %x\n", op.was & 0xffff, op.ifr.ifr_flags & 0xffff);
+      else
+         printf ("%s\n", opdone[op.type]);
    }
 }
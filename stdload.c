@@ -11,6 +11,7 @@
  * %  stdload -s 7 -c
  *                                 --Jamshid
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -18,6 +19,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -28,14 +30,17 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
 
 #include <netinet/in_systm.h>
 #include <netinet/in.h>
 
-#define MAXSES	10 /* maximum number of sessions */
 #define DEFG	"224.2.200.68"	/* default group (UGH!) */
 #define DEFP	12341		/* default port */
 #define TIMEBASE 20000		/* 20 mS = 50 Hz */
+#define GIGA	1000000000LL
 
 #define NOERROR(val,msg) {if (((int)(val)) < 0) {perror(msg);exit(1);}}
 #define NOTNULL(val,msg) {if (!(val)) {fprintf(stderr,msg);exit(1);}}
@@ -47,73 +52,412 @@
         (((stop).tv_sec - (start).tv_sec) * MEG + \
         ((stop).tv_usec - (start).tv_usec))
 
-#define TV2TS(tv) ((((tv)->tv_usec*0x431C) >> 15) + ((tv)->tv_sec << 16))
-
 char usage[] =
-"Usage: stdload [-s <sess>] [-t <ttl>] [-m] [-c] [<group>]\n\
+"Usage: stdload [-s <sess>] [-t <ttl>] [-m] [-c] [-f <sec>] [-F <file>] [-P <pct>]\n\
+               [-o text|json|csv] [-A] [-R] [<group>]\n\
     -s <n>       Use only selected sessions\n\
     -t <ttl>     Clamp all signals to <ttl>\n\
     -m           Margin test, raise rates by 5%% for each -m\n\
     -c           Chop mode,  5 sec on/off (sync to GMT)\n\
+    -f <sec>     Flood test, ignore rates and send as fast as possible\n\
+                 for <sec> seconds, then report the aggregate rate\n\
+    -F <file>    Load sessions from <file>, one per line:\n\
+                   <group> <port> <ttl> <payload> <raten>[/<rated>] <name>\n\
+                 sending <raten>/<rated> packets per 20 mS, or video:\n\
+                   <group> <port> <ttl> <payload> video <kb/s> <gop>[/<b>] <fps> <name>\n\
+                 with <b> B-frames between references, default 2\n\
+    -P <pct>     Pace each video frame over <pct>%% of the frame interval,\n\
+                 0 sends it as one burst, default %d\n\
+    -o <fmt>     Report format, once a second: text, JSON lines or CSV,\n\
+                 the last two with a row per session and one aggregate,\n\
+                 session \"*\", with lateness percentiles\n\
+    -A           Aggregate row only\n\
+    -R           Receive the sessions instead, report RTP loss, reordering\n\
+                 and jitter per SSRC\n\
     <group>      Multicast group, defaults to %s\n";
 
+/* RFC 3550 fixed header, no CSRCs, 12 bytes on every platform */
 struct rtp_head {
-/*  int ver:2, flow:6, P:1, S:1, for:6, seq16; */
-  int unsigned bits:16, seq:16;
-  long tstamp;
+  uint8_t vpxcc;		/* V=2, P, X, CC */
+  uint8_t mpt;			/* M, PT */
+  uint16_t seq;
+  uint32_t ts;
+  uint32_t ssrc;
 };
+#define RTP_VERSION 0x80
+#define RTP_MARKER  0x80
+
+/*
+ * Payload types, dynamic.  The payload is filler, so the type only
+ * tells the receiver which media clock the timestamps run at.
+ */
+#define PT_VIDEO    96		/* 90 kHz */
+#define PT_AUDIO    97		/* 8 kHz, everything that isn't video */
+#define CLOCK_VIDEO 90000
+#define CLOCK_AUDIO 8000
 /*
  * No - we must not fragment on tunnels either....
  * #define MPAY (1500 - 20 - 8 - sizeof(struct rtp_head))
  */
 #define MPAY 1400
+#define BATCH 64 /* packets per sendmmsg() */
+
+/*
+ * Video sessions send a GOP of frames, an I-frame followed by P-frames
+ * with <b> B-frames between them, each frame fragmented into <payload>
+ * sized packets.  Frame sizes are in proportion to these weights, and
+ * add up to the session's bitrate.
+ */
+#define WEIGHT_I 8
+#define WEIGHT_P 3
+#define WEIGHT_B 1
+#define DSPREAD	20		/* default -P */
 
+/* The built-in IETF broadcast, on consecutive ports from DEFP */
 struct session {
-  /* parameters */
   int ttl, payload;
   int raten, rated;
+  int kbps, gop, bfr, fps;	/* video, if fps is set */
   char *name;
-
-  /* state */
-  int seq;
-  int ratediv;
-  int port;
 } s[] = {
   {.ttl = 255, .payload =  320, .raten = 1, .rated = 4, .name = "GSM Audio 1"},
   {.ttl = 223, .payload =  320, .raten = 1, .rated = 4, .name = "GSM Audio 2"},
   {.ttl = 191, .payload =  160, .raten = 1, .rated = 1, .name = "PCM Audio 1"},
   {.ttl = 159, .payload =  160, .raten = 1, .rated = 1, .name = "PCM Audio 2"},
   {.ttl = 191, .payload =   50, .raten = 1, .rated = 1, .name = "Assorted control and listener messages"},
-  {.ttl = 127, .payload =  512, .raten = 1, .rated = 2, .name = "Video 1"},
-  {.ttl =  95, .payload =  512, .raten = 1, .rated = 2, .name = "Video 2"},
+  {.ttl = 127, .payload = MPAY, .kbps = 100, .gop = 12, .bfr = 2, .fps = 25, .name = "Video 1"},
+  {.ttl =  95, .payload = MPAY, .kbps = 100, .gop = 12, .bfr = 2, .fps = 25, .name = "Video 2"},
   {.ttl =  63, .payload = MPAY, .raten = 1, .rated = 1, .name = "Test Application1"},
   {.ttl =  63, .payload = MPAY, .raten = 1, .rated = 1, .name = "Test Application2"}
 };
 #define NSES (sizeof(s)/sizeof(struct session))
 #define DNS 4
-size_t ns = DNS;
+size_t ns;
+
+/* IP_TTL for sendmsg(), no setsockopt() per packet */
+union ctl {
+  char buf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr align;
+};
+
+/*
+ * The session table, built-in or loaded, as a struct of arrays.  The
+ * scheduler walks next[], period[] and link[], the sender only touches
+ * the rows of sessions that are due, and the rest is cold.
+ */
+struct table {
+  size_t n, size;
+
+  /* scheduling */
+  long long *next;		/* nS, CLOCK_MONOTONIC, next send */
+  long long *period;		/* nS between packets, or video frames */
+  int *link;			/* next session in the same wheel slot */
+
+  /* video */
+  long long *fstart;		/* nS, start of current frame */
+  long long *gap;		/* nS between packets of current frame */
+  int *frame;			/* index in GOP */
+  int *left;			/* bytes left of current frame */
+
+  /* sending */
+  struct sockaddr_in *sin;
+  union ctl *ctl;
+  int *payload;
+  uint16_t *seq;
+  uint32_t *ssrc, *tsbase;
+
+  /* statistics, see BUMP() */
+  long *sent, *failed;
+  long long *octets;
+  long long *late, *latemax;	/* nS, send-time error sum and max */
+  long long *ilatemax;		/* nS, max since the reporter last looked */
+
+  /* parameters */
+  int *ttl, *raten, *rated;
+  int *kbps, *gop, *bfr, *fps;
+  char **name;
+} tab;
 
-void ring(int signo);
-int ttlclamp=255, margin=0, chop=0;
+/*
+ * Timer wheel.  Each session hangs in the slot its next deadline falls
+ * in, and the slot is run as soon as it has passed, so the cost of a
+ * wakeup is the sessions that are due, not the size of the table, and
+ * there are at most one per slot however many sessions there are.
+ * Deadlines further out than one turn of the wheel stay in their slot
+ * until the right turn comes around.
+ */
+#define SLOT	50000LL		/* nS, 50 uS */
+#define SLOTS	4096		/* ~205 mS per turn */
+int wheel[SLOTS];
+long long cur;			/* next slot to run, absolute */
+
+/*
+ * The sender updates the statistics while the reporter thread reads
+ * them.  There is a single writer, so a relaxed load and store is all
+ * it takes, no locked read-modify-write on the send path.
+ */
+#define BUMP(x, n) __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define PEEK(x)    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define LATMAX 10000		/* uS, lateness histogram range */
+unsigned long lathist[LATMAX + 1];
+
+enum { FMT_TEXT, FMT_JSON, FMT_CSV };
+int format = FMT_TEXT, aggonly;
+
+void run(void);
+void lateness(int j, long long err);
+void second(void);
+void arm(void);
+void summary(FILE *out);
+void flood(int sec);
+void *reporter(void *arg);
+void list(void) __attribute__ ((noreturn));
+void receive(void);
+int ttlclamp=255, margin=0, chop=0, spread=DSPREAD;
 struct sockaddr_in grsin;
-struct itimerval timebase;
 struct timeval now;
-int os;
-int pkts, bytes, errors;
+long long epoch;		/* nS, CLOCK_MONOTONIC, media clock zero */
+int os, tfd, rep;
+long long pkts, bytes;
+int errors, calls;
 int tick, silent;
+volatile sig_atomic_t stop;
+
+/* Packets due in one wakeup, sent with a single sendmmsg() */
+struct mmsghdr msgs[BATCH];
+struct iovec iovs[BATCH][2];
+struct rtp_head heads[BATCH];
+int owner[BATCH];
+long long due[BATCH];		/* nS deadline, -1 for none */
+int nq;
+char payload[MPAY];
+
+void done(int signo __attribute__ ((unused)))
+{
+  stop = 1;
+}
+
+long long mono(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * GIGA + ts.tv_nsec;
+}
+
+#define GROW(p) NOTNULL(p = realloc(p, tab.size * sizeof(*p)), "Out of memory\n")
+
+void add(struct sockaddr_in *sin, struct session *p)
+{
+  size_t i = tab.n;
+
+  if (tab.n == tab.size) {
+    tab.size = tab.size ? tab.size * 2 : 64;
+    GROW(tab.next);
+    GROW(tab.period);
+    GROW(tab.link);
+    GROW(tab.fstart);
+    GROW(tab.gap);
+    GROW(tab.frame);
+    GROW(tab.left);
+    GROW(tab.sin);
+    GROW(tab.ctl);
+    GROW(tab.payload);
+    GROW(tab.seq);
+    GROW(tab.ssrc);
+    GROW(tab.tsbase);
+    GROW(tab.late);
+    GROW(tab.latemax);
+    GROW(tab.sent);
+    GROW(tab.failed);
+    GROW(tab.octets);
+    GROW(tab.ilatemax);
+    GROW(tab.ttl);
+    GROW(tab.raten);
+    GROW(tab.rated);
+    GROW(tab.kbps);
+    GROW(tab.gop);
+    GROW(tab.bfr);
+    GROW(tab.fps);
+    GROW(tab.name);
+  }
+
+  tab.sin[i] = *sin;
+  tab.payload[i] = p->payload;
+  tab.ttl[i] = p->ttl;
+  tab.raten[i] = p->raten;
+  tab.rated[i] = p->rated;
+  tab.kbps[i] = p->kbps;
+  tab.gop[i] = p->gop;
+  tab.bfr[i] = p->bfr;
+  tab.fps[i] = p->fps;
+  NOTNULL(tab.name[i] = strdup(p->name), "Out of memory\n");
+  tab.seq[i] = random();		/* RFC 3550 wants these random */
+  tab.tsbase[i] = random();
+  do
+    tab.ssrc[i] = random() ^ (random() << 16);
+  while (!tab.ssrc[i]);
+  tab.fstart[i] = tab.gap[i] = 0;
+  tab.frame[i] = tab.left[i] = 0;
+  tab.late[i] = tab.latemax[i] = 0;
+  tab.sent[i] = tab.failed[i] = 0;
+  tab.octets[i] = tab.ilatemax[i] = 0;
+  tab.n++;
+}
+
+/* Session file, see usage[] */
+void load(char *file)
+{
+  char line[256], group[64], rate[32], gop[32], *name;
+  int lineno = 0, port, off, more;
+  struct sockaddr_in sin;
+  struct session p;
+  FILE *fp;
+
+  NOTNULL(fp = fopen(file, "r"), "Cannot open session file\n");
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = 0;
+    name = line + strspn(line, " \t");
+    if (!*name || *name == '#')
+      continue;
+
+    bzero(&p, sizeof(p));
+    p.rated = 1;
+    p.bfr = 2;
+    if (sscanf(line, "%63s %d %d %d %31s %n", group, &port, &p.ttl, &p.payload,
+	       rate, &off) != 5 ||
+	port < 1 || port > 65535 || p.ttl < 0 || p.ttl > 255 ||
+	p.payload < 0 || p.payload > MPAY)
+      goto invalid;
+    if (!strcmp(rate, "video")) {
+      if (sscanf(line + off, "%d %31s %d %n", &p.kbps, gop, &p.fps, &more) != 3 ||
+	  sscanf(gop, "%d/%d", &p.gop, &p.bfr) < 1 ||
+	  p.kbps < 1 || p.gop < 1 || p.bfr < 0 || p.fps < 1 || p.fps > 1000 ||
+	  p.payload < 1)
+	goto invalid;
+      off += more;
+    } else if (sscanf(rate, "%d/%d", &p.raten, &p.rated) < 1 ||
+	       p.raten < 1 || p.rated < 1)
+      goto invalid;
+
+    bzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (!inet_aton(group, &sin.sin_addr)) {
+      fprintf(stderr, "%s:%d: invalid group %s\n", file, lineno, group);
+      exit(1);
+    }
+    p.name = line + off;
+    add(&sin, &p);
+    continue;
+  invalid:
+    fprintf(stderr, "%s:%d: invalid session\n", file, lineno);
+    exit(1);
+  }
+  fclose(fp);
+
+  if (!tab.n) {
+    fprintf(stderr, "%s: no sessions\n", file);
+    exit(1);
+  }
+}
+
+/* Bytes in frame <f> of a video GOP */
+int frame_bytes(int kbps, int gop, int bfr, int fps, int f)
+{
+  long long bytes = kbps * 1000LL / 8 * gop / fps;
+  int np = (gop - 1) / (bfr + 1);
+  int sum = WEIGHT_I + np * WEIGHT_P + (gop - 1 - np) * WEIGHT_B;
+  int w = !f ? WEIGHT_I : f % (bfr + 1) ? WEIGHT_B : WEIGHT_P;
+
+  bytes = bytes * w / sum;
+  return bytes > 0 ? bytes : 1;
+}
+
+void list(void)
+{
+  int r, sz, Tr, Tbw, f, b, pk, by;
+  size_t i;
+
+  printf("  -s <n> to include sessions 1 through <n> of:\n");
+/*       "d)  ddd  ddd  dddd   ddd   dddd   dddd nnnnnnnn"  */
+  printf("    ttl  pps  size  kb/S  T pps T kb/S\n");
+  Tr = Tbw = 0;
+  for (i=0; i<NSES; i++) {
+    if (s[i].fps) {				/* average over a GOP */
+      for (f = pk = by = 0; f < s[i].gop; f++) {
+	b = frame_bytes(s[i].kbps, s[i].gop, s[i].bfr, s[i].fps, f);
+	pk += (b + s[i].payload - 1) / s[i].payload;
+	by += b;
+      }
+      r = 100*pk*s[i].fps/s[i].gop;
+      sz = 20+8+sizeof(struct rtp_head)+by/pk;
+    } else {
+      r = 5000*s[i].raten/s[i].rated;		/* pay attention to roundoff */
+      sz = 20+8+sizeof(struct rtp_head)+s[i].payload;
+    }
+    Tr += r; Tbw += r*sz;
+    printf("%zu)  %3d  %3d  %4d %4d   %4d   %4d %s\n",
+	   i + 1, s[i].ttl, r/100, sz, r*sz*8/100000, Tr/100, Tbw*8/100000,
+	   s[i].name);
+  }
+  printf("(Defaults to 1 through %d)\n", DNS);
+  exit(1);
+}
+
+/* Start the next frame of a video session at <at> */
+void newframe(int j, long long at)
+{
+  int n;
+
+  if (++tab.frame[j] >= tab.gop[j])
+    tab.frame[j] = 0;
+  tab.left[j] = frame_bytes(tab.kbps[j], tab.gop[j], tab.bfr[j], tab.fps[j],
+			    tab.frame[j]);
+  n = (tab.left[j] + tab.payload[j] - 1) / tab.payload[j];
+  tab.gap[j] = tab.period[j] * spread / 100 / n;
+  tab.fstart[j] = at;
+  tab.next[j] = at;
+}
+
+/* Account for a packet sent, or skipped, and set the next deadline */
+void advance(int j)
+{
+  if (!tab.fps[j]) {
+    tab.next[j] += tab.period[j];
+    return;
+  }
+
+  tab.left[j] -= tab.left[j] < tab.payload[j] ? tab.left[j] : tab.payload[j];
+  if (tab.left[j] > 0)
+    tab.next[j] += tab.gap[j];
+  else
+    newframe(j, tab.fstart[j] + tab.period[j]);
+}
+
+void insert(int j)
+{
+  int slot = (tab.next[j] / SLOT) & (SLOTS - 1);
 
-struct {
-  struct rtp_head h;
-  char data[MPAY];
-} outbuf;
+  tab.link[j] = wheel[slot];
+  wheel[slot] = j;
+}
 
 int main(int argc, char *argv[])
 {
-  char *sv, **av = argv, *name = DEFG;
+  char *sv, **av = argv, *name = DEFG, *file = NULL;
   struct hostent *hp;
-  int port = DEFP;
-  int r, sz, Tr, Tbw;
+  int port = DEFP, flood_sec = 0, recv_mode = 0;
+  pthread_t tid;
+  sigset_t set, old;
+  int ttl;
   int sockbuf=32767;
+  int sfd, ep;
+  struct epoll_event ev, evs[2];
+  struct itimerspec its;
+  long long start;
   size_t i;
 
   argc--, av++;
@@ -122,25 +466,11 @@ int main(int argc, char *argv[])
     while (*++sv) switch (*sv) {
     case 's':
       if ((argc > 0) &&
-	  ((ns = atoi(*av++)) > 0) &&
-	  (ns <= NSES)) {
+	  ((int)(ns = atoi(*av++)) > 0)) {
 	argc--;
         break;
       }
-      printf("  -s <n> to include sessions 1 through <n> of:\n");
-/*           "d)  ddd  ddd  dddd   ddd   dddd   dddd nnnnnnnn"  */
-      printf("    ttl  pps  size  kb/S  T pps T kb/S\n");
-      Tr = Tbw = 0;
-      for (i=0; i<NSES; i++) {
-	r = 5000*s[i].raten/s[i].rated;		/* pay attention to roundoff */
-	sz = 20+8+sizeof(struct rtp_head)+s[i].payload;
-	Tr += r; Tbw += r*sz;
-	printf("%zu)  %3d  %3d  %4d %4d   %4d   %4d %s\n",
-	       i + 1, s[i].ttl, r/100, sz, r*sz*8/100000, Tr/100, Tbw*8/100000,
-	       s[i].name);
-      }
-      printf("(Defaults to 1 through %d)\n", DNS);
-      exit(1);
+      list();
     case 't':
       if ((argc > 0) &&
           ((ttlclamp = atoi(*av++)) >= 0) &&
@@ -148,7 +478,7 @@ int main(int argc, char *argv[])
         argc--;
         break;
       }
-      printf(usage, DEFG);
+      printf(usage, DSPREAD, DEFG);
       printf("Invalid argument to -%c\n", *sv);
       exit(1);
     case 'm':
@@ -157,13 +487,66 @@ int main(int argc, char *argv[])
     case 'c':
       chop++;
       break;
+    case 'R':
+      recv_mode++;
+      break;
+    case 'A':
+      aggonly++;
+      break;
+    case 'o':
+      if (argc > 0) {
+	argc--;
+	sv = *av++;
+	if (!strcmp(sv, "text"))
+	  format = FMT_TEXT;
+	else if (!strcmp(sv, "json"))
+	  format = FMT_JSON;
+	else if (!strcmp(sv, "csv"))
+	  format = FMT_CSV;
+	else {
+	  printf("Unknown report format: %s\n", sv);
+	  exit(1);
+	}
+	sv = "o";
+	break;
+      }
+      printf(usage, DSPREAD, DEFG);
+      printf("Missing argument to -%c\n", *sv);
+      exit(1);
+    case 'f':
+      if ((argc > 0) && ((flood_sec = atoi(*av++)) > 0)) {
+        argc--;
+        break;
+      }
+      printf(usage, DSPREAD, DEFG);
+      printf("Invalid argument to -%c\n", *sv);
+      exit(1);
+    case 'P':
+      if ((argc > 0) &&
+	  ((spread = atoi(*av++)) >= 0) &&
+	  (spread <= 100)) {
+	argc--;
+	break;
+      }
+      printf(usage, DSPREAD, DEFG);
+      printf("Invalid argument to -%c\n", *sv);
+      exit(1);
+    case 'F':
+      if (argc > 0) {
+	file = *av++;
+	argc--;
+	break;
+      }
+      printf(usage, DSPREAD, DEFG);
+      printf("Missing argument to -%c\n", *sv);
+      exit(1);
     default:
-      printf(usage, DEFG);
+      printf(usage, DSPREAD, DEFG);
       printf("Unknown switch: -%c\n", *sv);
       exit(1);
     }
   }
-  if (*av) name = *av; 
+  if (*av) name = *av;
   if (isdigit(*name)) {
     grsin.sin_addr.s_addr = inet_addr(name);
   } else if ((hp = gethostbyname(name))) {
@@ -173,73 +556,866 @@ int main(int argc, char *argv[])
     exit(1);
   }
   grsin.sin_family = AF_INET;
+
+  srandom(time(NULL) ^ getpid());
+  if (file) {
+    load(file);
+    if (!ns || ns > tab.n)
+      ns = tab.n;
+  } else {
+    if (!ns)
+      ns = DNS;
+    if (ns > NSES)
+      list();
+    for (i=0; i<ns; i++) {
+      grsin.sin_port = htons(port++);
+      add(&grsin, &s[i]);
+    }
+  }
+  tab.n = ns;
+  if (recv_mode) {
+    receive();
+    return 0;
+  }
+
   NOERROR(os = socket(AF_INET, SOCK_DGRAM, 0), "socket");
   NOERROR(setsockopt(os, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(int)),
 	  "SO_SNDBUF");
-  for (i=0; i<NSES; i++) {
-    s[i].port = htons(port++);
+  /* IP_TTL cmsgs must be 1..255, so a clamp to 0 is set once instead */
+  if (!ttlclamp) {
+    unsigned char zero = 0;
+    NOERROR(setsockopt(os, IPPROTO_IP, IP_MULTICAST_TTL, &zero, 1), "ttl");
+  }
+  for (i=0; i<tab.n; i++) {
+    struct cmsghdr *cm = &tab.ctl[i].align;
+
+    ttl = (tab.ttl[i] > ttlclamp)?ttlclamp:tab.ttl[i];
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_TTL;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &ttl, sizeof(int));
+  }
+  memset(wheel, -1, sizeof(wheel));
+  start = epoch = mono();
+  cur = start / SLOT;
+  for (i=0; i<tab.n; i++) {
+    if (tab.fps[i]) {
+      /* Staggered GOPs too, so the I-frames don't line up */
+      tab.period[i] = GIGA * (TIMEBASE-(TIMEBASE*margin/20)) / TIMEBASE / tab.fps[i];
+      tab.frame[i] = (int)(i % tab.gop[i]) - 1;
+      newframe(i, start + tab.period[i] * i / tab.n);
+    } else {
+      tab.period[i] = (TIMEBASE-(TIMEBASE*margin/20)) * 1000LL * tab.rated[i] / tab.raten[i];
+      tab.next[i] = start + tab.period[i] * i / tab.n;
+    }
+    insert(i);
+  }
+  if (flood_sec) {
+    flood(flood_sec);
+    return 0;
   }
 
+  /*
+   * Sessions are scheduled on a CLOCK_MONOTONIC timerfd, armed for the
+   * first occupied slot of the wheel, so a session's packets are spread
+   * evenly over its period and sessions are staggered against each
+   * other.  A second timerfd on CLOCK_REALTIME fires on every whole
+   * second for chop mode, which is synced to GMT.  Reports come from a
+   * thread of their own, so printing never holds up the sender.
+   */
+  NOERROR(tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK), "timerfd");
+  NOERROR(sfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK), "timerfd");
+  NOERROR(ep = epoll_create1(0), "epoll_create1");
+  ev.events = EPOLLIN;
+  ev.data.fd = tfd;
+  NOERROR(epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev), "epoll_ctl");
+  ev.data.fd = sfd;
+  NOERROR(epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev), "epoll_ctl");
+  prctl(PR_SET_TIMERSLACK, 1);
+
   gettimeofday(&now, 0);
-  tick = now.tv_sec-1;
-  silent = chop;
-  if (SIG_ERR == signal(SIGALRM, ring))
-  {
-    perror("signal");
-    exit(1);
+  tick = now.tv_sec;
+  silent = chop ? (tick%10) >= 5 : 0;
+  bzero(&its, sizeof(its));
+  its.it_value.tv_sec = now.tv_sec + 1;
+  its.it_interval.tv_sec = 1;
+  NOERROR(timerfd_settime(sfd, TFD_TIMER_ABSTIME, &its, 0), "timerfd_settime");
+
+  arm();
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  errno = pthread_create(&tid, NULL, reporter, NULL);
+  NOERROR(-errno, "pthread_create");
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  signal(SIGINT, done);
+  signal(SIGTERM, done);
+  while (!stop) {
+    int n = epoll_wait(ep, evs, 2, -1);
+
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    while (n-- > 0) {
+      uint64_t exp;
+
+      if (read(evs[n].data.fd, &exp, sizeof(exp)) < 0)
+	continue;
+      if (evs[n].data.fd == sfd)
+	second();
+      else {
+	run();
+	arm();
+      }
+    }
+  }
+  pthread_cancel(tid);
+  pthread_join(tid, NULL);
+  summary(format == FMT_TEXT ? stdout : stderr);
+
+  return 0;
+}
+
+/* Arm the session timer for the end of the first slot with work in it */
+void arm(void)
+{
+  struct itimerspec its;
+  long long slot, first = (cur + SLOTS) * SLOT;
+  int j = -1;
+
+  for (slot = cur; slot < cur + SLOTS; slot++) {
+    for (j = wheel[slot & (SLOTS - 1)]; j != -1; j = tab.link[j])
+      if (tab.next[j] < (slot + 1) * SLOT)
+	break;
+    if (j != -1) {
+      first = (slot + 1) * SLOT;
+      break;
+    }
+  }
+
+  bzero(&its, sizeof(its));
+  its.it_value.tv_sec = first / GIGA;
+  its.it_value.tv_nsec = first % GIGA;
+  NOERROR(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, 0), "timerfd_settime");
+}
+
+/* Once a second, on the second: flip chop mode */
+void second(void)
+{
+  tick++;
+  if (chop)
+    __atomic_store_n(&silent, (tick%10) >= 5, __ATOMIC_RELAXED);
+}
+
+/*
+ * Send all queued packets, in as few calls as the kernel allows.  The
+ * clock is read as each call returns, so lateness includes the wait
+ * in the queue and the sendmmsg() itself.
+ */
+void flush(void)
+{
+  int i = 0, r, k;
+  long long t;
+
+  while (i < nq) {
+    r = sendmmsg(os, &msgs[i], nq - i, 0);
+    calls++;
+    t = mono();
+    if (r <= 0) {		/* Skip the one that failed */
+      errors++;
+      BUMP(tab.failed[owner[i]], 1);
+      if (due[i] >= 0)
+	lateness(owner[i], t - due[i]);
+      i++;
+      continue;
+    }
+    for (k = i; k < i + r; k++) {
+      BUMP(tab.sent[owner[k]], 1);
+      BUMP(tab.octets[owner[k]], 20 + 8 + msgs[k].msg_len);
+      if (due[k] >= 0)
+	lateness(owner[k], t - due[k]);
+    }
+    i += r;
+  }
+  nq = 0;
+}
+
+/*
+ * The RTP timestamp is the packet's media time: its deadline, or for
+ * video the frame's, on a 90 kHz or 8 kHz clock from a random base.
+ * Every packet of a frame has the same timestamp and the last one has
+ * the marker bit set.
+ */
+void queue(int i, long long deadline)
+{
+  struct rtp_head *h = &heads[nq];
+  struct msghdr *mh = &msgs[nq].msg_hdr;
+  long long usec = ((tab.fps[i] ? tab.fstart[i] : tab.next[i]) - epoch) / 1000;
+
+  h->vpxcc = RTP_VERSION;
+  h->mpt = tab.fps[i] ? PT_VIDEO : PT_AUDIO;
+  if (tab.fps[i] && tab.left[i] <= tab.payload[i])
+    h->mpt |= RTP_MARKER;
+  h->seq = htons(tab.seq[i]++);
+  h->ts = htonl(tab.tsbase[i] +
+		(uint32_t)(usec * (tab.fps[i] ? CLOCK_VIDEO : CLOCK_AUDIO) / 1000000));
+  h->ssrc = htonl(tab.ssrc[i]);
+  iovs[nq][0].iov_base = h;
+  iovs[nq][0].iov_len = sizeof(*h);
+  iovs[nq][1].iov_base = payload;
+  iovs[nq][1].iov_len = tab.payload[i];
+  if (tab.fps[i] && tab.left[i] < tab.payload[i])
+    iovs[nq][1].iov_len = tab.left[i];	/* last fragment of a frame */
+
+  mh->msg_name = &tab.sin[i];
+  mh->msg_namelen = sizeof(tab.sin[i]);
+  mh->msg_iov = iovs[nq];
+  mh->msg_iovlen = 2;
+  mh->msg_control = ttlclamp ? tab.ctl[i].buf : NULL;
+  mh->msg_controllen = ttlclamp ? sizeof(tab.ctl[i].buf) : 0;
+  mh->msg_flags = 0;
+  owner[nq] = i;
+  due[nq++] = deadline;
+
+  if (nq == BATCH)
+    flush();
+}
+
+/*
+ * The interval max is also reset by the reporter, so it is the one
+ * statistic that needs a real atomic, and only when it grows.
+ */
+void lateness(int j, long long err)
+{
+  long long max = PEEK(tab.ilatemax[j]), usec = err / 1000;
+
+  BUMP(tab.late[j], err);
+  if (err > tab.latemax[j])
+    tab.latemax[j] = err;
+  while (err > max &&
+	 !__atomic_compare_exchange_n(&tab.ilatemax[j], &max, err, 0,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  BUMP(lathist[usec < LATMAX ? usec : LATMAX], 1);
+}
+
+/*
+ * Run every wheel slot that has passed, sending the packets due in it;
+ * flush() records how late they go out.  Sessions hashed to a slot but
+ * due on a later turn are put back as they were.
+ */
+void run(void)
+{
+  long long t = mono(), upto = t / SLOT - 1, slot, end;
+  int j, chain;
+
+  if (upto - cur >= SLOTS)	/* Stalled more than a turn */
+    cur = upto - SLOTS + 1;
+  for (slot = cur; slot <= upto; slot++) {
+    chain = wheel[slot & (SLOTS - 1)];
+    wheel[slot & (SLOTS - 1)] = -1;
+    end = (slot + 1) * SLOT;
+
+    while (chain != -1) {
+      j = chain;
+      chain = tab.link[j];
+
+      while (tab.next[j] < end) {
+	if (!silent)
+	  queue(j, tab.next[j]);
+
+	advance(j);
+	if (t - tab.next[j] > GIGA) { /* Stalled, don't try to catch up */
+	  tab.fstart[j] += t - tab.next[j];
+	  tab.next[j] = t;
+	}
+      }
+      insert(j);
+    }
+  }
+  cur = upto + 1;
+  flush();
+}
+
+/* One packet from each session per round, back-to-back */
+void flood(int sec)
+{
+  long long start = mono(), end = start + sec * GIGA, t;
+  long long total = 0, octets = 0;
+  size_t i;
+
+  printf("Flooding %zu sessions for %d sec\n", tab.n, sec);
+  fflush(stdout);
+  do {
+    for (i = 0; i < tab.n; i++) {
+      queue(i, -1);
+      advance(i);
+    }
+    flush();
+  } while ((t = mono()) < end);
+
+  t -= start;
+  for (i = 0; i < tab.n; i++) {
+    total += tab.sent[i];
+    octets += tab.octets[i];
+  }
+  printf("%lld pkts in %.3f sec, %.0f pps, %.0f kb/S, %d errors, %.1f pkts/syscall\n",
+	 total, (double)t / GIGA, total * (double)GIGA / t,
+	 octets * 8.0 / 1000 * GIGA / t, errors, calls ? (double)total / calls : 0.0);
+}
+
+int bylate(const void *a, const void *b)
+{
+  long long x = tab.latemax[*(const int *)a], y = tab.latemax[*(const int *)b];
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Per-session table, or only the worst ten when there are many */
+void summary(FILE *out)
+{
+  size_t i, num = tab.n;
+  int *order;
+  long n;
+
+  NOTNULL(order = malloc(tab.n * sizeof(int)), "Out of memory\n");
+  for (i = 0; i < tab.n; i++)
+    order[i] = i;
+  if (tab.n > 64) {
+    qsort(order, tab.n, sizeof(int), bylate);
+    num = 10;
+    fprintf(out, "\n%zu sessions, %zu with the largest max lateness:", tab.n, num);
+  }
+
+  fprintf(out, "\n%-40s %8s %6s %10s %10s\n", "Session", "Sent", "Errors",
+	  "Late avg", "Late max");
+  for (i = 0; i < num; i++) {
+    int j = order[i];
+
+    n = tab.sent[j] + tab.failed[j];
+    fprintf(out, "%-40s %8ld %6ld %7lld uS %7lld uS\n", tab.name[j], tab.sent[j],
+	    tab.failed[j], n ? tab.late[j]/n/1000 : 0, tab.latemax[j]/1000);
+  }
+  free(order);
+}
+
+/*
+ * Reporter thread.  Once a second, on the second, it takes the
+ * difference of every counter since last time, so the sender never
+ * has to reset anything, and prints one row per session and one for
+ * all of them.  Lateness percentiles come from the aggregate usec
+ * histogram, the same way.
+ */
+struct snap {
+  long sent, failed;
+  long long octets, late;
+} *prev;
+unsigned long prevhist[LATMAX + 1], ihist[LATMAX + 1];
+
+/* Percentile <p> of the interval histogram, in uS */
+int pct(unsigned long count, double p)
+{
+  unsigned long sum = 0;
+  int i;
+
+  for (i = 0; i < LATMAX && (sum + ihist[i]) * 100.0 < p * count; i++)
+    sum += ihist[i];
+  return i;
+}
+
+/* JSON string, or CSV field, with the quoting each needs */
+void quote(const char *str)
+{
+  putchar('"');
+  for (; *str; str++) {
+    if (*str == '"')
+      fputs(format == FMT_JSON ? "\\\"" : "\"\"", stdout);
+    else if (*str == '\\' && format == FMT_JSON)
+      fputs("\\\\", stdout);
+    else if ((unsigned char)*str >= 0x20)
+      putchar(*str);
+  }
+  putchar('"');
+}
+
+void row(time_t sec, int j, long pps, long long octets, long errs,
+	 long long avg, long long max, unsigned long count)
+{
+  char group[INET_ADDRSTRLEN] = "";
+  int port = 0;
+
+  if (j >= 0) {
+    inet_ntop(AF_INET, &tab.sin[j].sin_addr, group, sizeof(group));
+    port = ntohs(tab.sin[j].sin_port);
+  }
+
+  if (format == FMT_JSON) {
+    printf("{\"time\":%ld,\"session\":", (long)sec);
+    quote(j >= 0 ? tab.name[j] : "*");
+    if (j >= 0)
+      printf(",\"group\":\"%s\",\"port\":%d", group, port);
+    else
+      printf(",\"sessions\":%zu", tab.n);
+    printf(",\"pps\":%ld,\"kbps\":%lld,\"errors\":%ld,"
+	   "\"late_avg_us\":%lld,\"late_max_us\":%lld", pps, octets*8/1000,
+	   errs, avg/1000, max/1000);
+    if (j < 0)
+      printf(",\"late_p50_us\":%d,\"late_p90_us\":%d,\"late_p99_us\":%d,"
+	     "\"late_p999_us\":%d", pct(count, 50), pct(count, 90),
+	     pct(count, 99), pct(count, 99.9));
+    printf("}\n");
+  } else {
+    printf("%ld,", (long)sec);
+    quote(j >= 0 ? tab.name[j] : "*");
+    if (j >= 0)
+      printf(",%s,%d", group, port);
+    else
+      printf(",,");
+    printf(",%ld,%lld,%ld,%lld,%lld", pps, octets*8/1000, errs, avg/1000,
+	   max/1000);
+    if (j < 0)
+      printf(",%d,%d,%d,%d\n", pct(count, 50), pct(count, 90),
+	     pct(count, 99), pct(count, 99.9));
+    else
+      printf(",,,,\n");
+  }
+}
+
+void report(time_t sec)
+{
+  long long octets = 0, late = 0, max = 0;
+  unsigned long count = 0;
+  long sent = 0, failed = 0;
+  size_t j;
+  int i;
+
+  for (i = 0; i <= LATMAX; i++) {
+    unsigned long v = PEEK(lathist[i]);
+
+    ihist[i] = v - prevhist[i];
+    prevhist[i] = v;
+    count += ihist[i];
+  }
+
+  for (j = 0; j < tab.n; j++) {
+    struct snap now = {
+      PEEK(tab.sent[j]), PEEK(tab.failed[j]), PEEK(tab.octets[j]), PEEK(tab.late[j])
+    };
+    long long imax = __atomic_exchange_n(&tab.ilatemax[j], 0, __ATOMIC_RELAXED);
+    long ds = now.sent - prev[j].sent, df = now.failed - prev[j].failed;
+    long long dl = now.late - prev[j].late;
+
+    if (format != FMT_TEXT && !aggonly)
+      row(sec, j, ds, now.octets - prev[j].octets, df,
+	  ds + df ? dl / (ds + df) : 0, imax, 0);
+    sent += ds;
+    failed += df;
+    octets += now.octets - prev[j].octets;
+    late += dl;
+    if (imax > max)
+      max = imax;
+    prev[j] = now;
+  }
+
+  if (format != FMT_TEXT)
+    row(sec, -1, sent, octets, failed, sent + failed ? late / (sent + failed) : 0,
+	max, count);
+  else if (PEEK(silent)) {
+    putchar('.');
+    if ((sec%10) == 9) printf("\n");
+  } else
+    printf("%3ld %5lld %ld %lld %lld %d %d\n", sent, octets*8/1000, failed,
+	   sent + failed ? late/(sent + failed)/1000 : 0, max/1000,
+	   pct(count, 50), pct(count, 99));
+  fflush(stdout);
+}
+
+void *reporter(void *arg __attribute__ ((unused)))
+{
+  struct timespec ts;
+  int state;
+
+  NOTNULL(prev = calloc(tab.n, sizeof(*prev)), "Out of memory\n");
+  if (format == FMT_TEXT)
+    printf("pkts kb/S errors late(avg max p50 p99 uS)\n");
+  else if (format == FMT_CSV)
+    printf("time,session,group,port,pps,kbps,errors,late_avg_us,late_max_us,"
+	   "late_p50_us,late_p90_us,late_p99_us,late_p999_us\n");
+  fflush(stdout);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec = 0;
+  while (1) {
+    ts.tv_sec++;
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+
+    /* Don't get cancelled holding the stdout lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    report(ts.tv_sec);
+    pthread_setcancelstate(state, NULL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Receive mode, -R.  Joins the group and port of every session in the
+ * table, and keeps RFC 3550 receiver statistics per SSRC: extended
+ * highest sequence number, loss, packets out of order and interarrival
+ * jitter, as in appendix A.1 and A.8.  Only the RTP header of each
+ * packet is read, in batches, with its kernel receive timestamp.
+ */
+#define RTP_SEQ_MOD  (1 << 16)
+#define MAX_DROPOUT  3000
+#define MAX_MISORDER 100
+
+struct source {
+  uint32_t ssrc;
+  int used, clock;
+  struct sockaddr_in from;
+  uint16_t max_seq;
+  uint32_t cycles, base_seq, bad_seq;
+  long received, reordered;
+  long long bytes;
+  uint32_t transit;		/* media clock units */
+  double jitter;
+};
+
+struct source *srcs;
+size_t nsrcs, srcsize;
+long long repoch;		/* nS, first arrival, receiver clock zero */
+
+struct rsock {
+  int fd, port;
+} *rs;
+size_t nrs;
+
+struct mmsghdr rmsgs[BATCH];
+struct iovec riovs[BATCH];
+struct rtp_head rheads[BATCH];
+struct sockaddr_in rfrom[BATCH];
+union {
+  char buf[CMSG_SPACE(sizeof(struct timespec))];
+  struct cmsghdr align;
+} rctl[BATCH];
+
+/* Open addressing on SSRC, kept at most half full */
+struct source *lookup(uint32_t ssrc)
+{
+  size_t i, j, mask;
+
+  if ((nsrcs + 1) * 2 > srcsize) {
+    struct source *old = srcs;
+    size_t oldsize = srcsize;
+
+    srcsize = srcsize ? srcsize * 2 : 1024;
+    NOTNULL(srcs = calloc(srcsize, sizeof(*srcs)), "Out of memory\n");
+    mask = srcsize - 1;
+    for (i = 0; i < oldsize; i++) {
+      if (!old[i].used)
+	continue;
+      j = (old[i].ssrc * 2654435761u) & mask;
+      while (srcs[j].used)
+	j = (j + 1) & mask;
+      srcs[j] = old[i];
+    }
+    free(old);
+  }
+
+  mask = srcsize - 1;
+  for (i = (ssrc * 2654435761u) & mask; srcs[i].used; i = (i + 1) & mask)
+    if (srcs[i].ssrc == ssrc)
+      return &srcs[i];
+
+  srcs[i].used = 1;
+  srcs[i].ssrc = ssrc;
+  nsrcs++;
+  return &srcs[i];
+}
+
+void init_seq(struct source *src, uint16_t seq)
+{
+  src->base_seq = seq;
+  src->max_seq = seq;
+  src->bad_seq = RTP_SEQ_MOD + 1;
+  src->cycles = 0;
+  src->received = 0;
+}
+
+long lost(struct source *src)
+{
+  return (long)(src->cycles + src->max_seq - src->base_seq + 1) - src->received;
+}
+
+void update(struct source *src, struct rtp_head *h, int len, long long arrival)
+{
+  uint16_t seq = ntohs(h->seq), udelta;
+  uint32_t transit;
+  int32_t d;
+
+  if (!src->clock) {		/* first packet */
+    src->clock = (h->mpt & 0x7f) == PT_VIDEO ? CLOCK_VIDEO : CLOCK_AUDIO;
+    init_seq(src, seq);
   }
 
-  bzero(&timebase, sizeof(timebase));
-  timebase.it_value.tv_usec = timebase.it_interval.tv_usec =
-    TIMEBASE-(TIMEBASE*margin/20);
-  NOERROR(setitimer(ITIMER_REAL, &timebase, 0), "setitimer");
-  printf("pkts kb/S errors\n");
-  for (;;) pause();
+  udelta = seq - src->max_seq;
+  if (udelta < MAX_DROPOUT) {
+    if (seq < src->max_seq)
+      src->cycles += RTP_SEQ_MOD;
+    src->max_seq = seq;
+  } else if (udelta <= RTP_SEQ_MOD - MAX_MISORDER) {
+    /* A big jump, a restarted sender if the next one follows on */
+    if (seq != src->bad_seq) {
+      src->bad_seq = (seq + 1) & (RTP_SEQ_MOD - 1);
+      return;
+    }
+    init_seq(src, seq);
+  } else
+    src->reordered++;		/* out of order, or duplicate */
+  src->received++;
+  src->bytes += 20 + 8 + len;
+
+  transit = (uint32_t)((arrival - repoch) / 1000 * src->clock / 1000000) - ntohl(h->ts);
+  d = transit - src->transit;
+  src->transit = transit;
+  if (src->received > 1)
+    src->jitter += ((d < 0 ? -d : d) - src->jitter) / 16;
+}
+
+int rsocket(int port)
+{
+  struct sockaddr_in sin;
+  struct epoll_event ev;
+  int sd, on = 1, off = 0, size = 4 << 20;
+
+  NOERROR(sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0), "socket");
+  NOERROR(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)), "SO_REUSEADDR");
+  NOERROR(setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)), "SO_TIMESTAMPNS");
+  NOERROR(setsockopt(sd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off)), "IP_MULTICAST_ALL");
+  if (setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  bzero(&sin, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = port;
+  NOERROR(bind(sd, (struct sockaddr *)&sin, sizeof(sin)), "bind");
+
+  ev.events = EPOLLIN;
+  ev.data.fd = sd;
+  NOERROR(epoll_ctl(rep, EPOLL_CTL_ADD, sd, &ev), "epoll_ctl");
+
+  NOTNULL(rs = realloc(rs, (nrs + 1) * sizeof(*rs)), "Out of memory\n");
+  rs[nrs].fd = sd;
+  rs[nrs].port = port;
+  nrs++;
+
+  return sd;
 }
 
-void ring(int signo __attribute__ ((unused)))
+/*
+ * Join on the newest socket bound to the session's port, a new one
+ * when it is full.  Each socket only gets its own groups, so sessions
+ * on the same port but different groups are not seen twice.
+ */
+void rjoin(struct sockaddr_in *sin)
 {
-  int tsnow;
+  struct ip_mreq imr;
+  int sd = -1;
   size_t i;
 
-  if (SIG_ERR == signal(SIGALRM, ring))
-  {
-    perror("signal");
-    exit(1);
+  for (i = nrs; i > 0; i--) {
+    if (rs[i - 1].port == sin->sin_port) {
+      sd = rs[i - 1].fd;
+      break;
+    }
   }
-  gettimeofday(&now, 0);
-  if (tick != now.tv_sec) {
-    if (silent) {
-     putc('.', stdout);
-     if ((tick%10) == 9) printf("\n");
-     fflush(stdout);
-    } else
-      printf("%3d %5d %d\n", pkts, bytes*8/1000, errors);
-    pkts = bytes = errors =0;
-    tick++;
-    if (chop) silent = (tick%10) >= 5;
-  }
-  if (silent) return;
-  tsnow = TV2TS(&now);
-
-  for (i = 0; i < ns; i++) {
-    unsigned char ttl;
-    s[i].ratediv += s[i].raten;
-    while (s[i].ratediv >= s[i].rated) {
-      s[i].ratediv -= s[i].rated;
-
-      outbuf.h.bits = htons(0x4040);
-      outbuf.h.seq = htons(s[i].seq++);
-      outbuf.h.tstamp = htonl(tsnow);
-      ttl = (s[i].ttl > ttlclamp)?ttlclamp:s[i].ttl;
-      NOERROR(setsockopt(os, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, 1), "ttl");
-      grsin.sin_port = s[i].port;
-      if (sendto(os, (char *)&outbuf, sizeof(struct rtp_head)+s[i].payload, 0,
-                 (struct sockaddr *)&grsin, sizeof(grsin)) > 0) {
-	pkts++;
-	bytes += 20 + 8 + sizeof(struct rtp_head)+s[i].payload;
-      } else
+
+  imr.imr_multiaddr = sin->sin_addr;
+  imr.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (sd == -1)
+    sd = rsocket(sin->sin_port);
+  if (!setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(imr)) ||
+      errno == EADDRINUSE)
+    return;
+  if (errno == ENOBUFS) {
+    sd = rsocket(sin->sin_port);
+    if (!setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(imr)))
+      return;
+  }
+  fprintf(stderr, "Cannot join %s: %s\n", inet_ntoa(sin->sin_addr), strerror(errno));
+  exit(1);
+}
+
+void drain(int sd)
+{
+  struct timespec ts;
+  struct cmsghdr *cm;
+  long long arrival;
+  int i, n;
+
+  while ((n = recvmmsg(sd, rmsgs, BATCH, MSG_TRUNC, NULL)) > 0) {
+    calls++;
+    for (i = 0; i < n; i++) {
+      struct msghdr *mh = &rmsgs[i].msg_hdr;
+      struct source *src;
+
+      if (rmsgs[i].msg_len < sizeof(struct rtp_head) ||
+	  (rheads[i].vpxcc & 0xc0) != RTP_VERSION) {
 	errors++;
+	continue;
+      }
+
+      arrival = 0;
+      for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+	if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+	  memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+	  arrival = ts.tv_sec * GIGA + ts.tv_nsec;
+	}
+      }
+      if (!arrival) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	arrival = ts.tv_sec * GIGA + ts.tv_nsec;
+      }
+      if (!repoch)
+	repoch = arrival;
+
+      src = lookup(ntohl(rheads[i].ssrc));
+      src->from = rfrom[i];
+      update(src, &rheads[i], rmsgs[i].msg_len, arrival);
+      pkts++;
+      bytes += 20 + 8 + rmsgs[i].msg_len;
+    }
+
+    /* recvmmsg() clobbers these */
+    for (i = 0; i < n; i++) {
+      rmsgs[i].msg_hdr.msg_namelen = sizeof(rfrom[i]);
+      rmsgs[i].msg_hdr.msg_controllen = sizeof(rctl[i].buf);
+    }
+  }
+}
+
+/* Once a second: what came in, and what has gone missing since last */
+void rsecond(void)
+{
+  static long prevlost, prevreord;
+  long l = 0, r = 0;
+  size_t i;
+
+  for (i = 0; i < srcsize; i++) {
+    if (srcs[i].used && srcs[i].clock) {
+      l += lost(&srcs[i]);
+      r += srcs[i].reordered;
+    }
+  }
+  printf("%6lld %7lld %6ld %6ld %6zu\n", pkts, bytes*8/1000, l - prevlost,
+	 r - prevreord, nsrcs);
+  fflush(stdout);
+  prevlost = l;
+  prevreord = r;
+  pkts = bytes = 0;
+}
+
+int byloss(const void *a, const void *b)
+{
+  long x = lost(*(struct source * const *)a), y = lost(*(struct source * const *)b);
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void rsummary(void)
+{
+  struct source **order;
+  size_t i, n = 0, num;
+
+  NOTNULL(order = malloc((nsrcs + 1) * sizeof(*order)), "Out of memory\n");
+  for (i = 0; i < srcsize; i++)
+    if (srcs[i].used && srcs[i].clock)
+      order[n++] = &srcs[i];
+  num = n;
+  if (n > 64) {
+    qsort(order, n, sizeof(*order), byloss);
+    num = 10;
+    printf("\n%zu sources, %zu with the most loss:", n, num);
+  }
+
+  printf("\n%-8s %-21s %9s %8s %6s %9s %10s\n", "SSRC", "Source", "Received",
+	 "Lost", "Loss%", "Reordered", "Jitter mS");
+  for (i = 0; i < num; i++) {
+    struct source *src = order[i];
+    long expected = src->received + lost(src);
+    char from[32];
+
+    snprintf(from, sizeof(from), "%s:%d", inet_ntoa(src->from.sin_addr),
+	     ntohs(src->from.sin_port));
+    printf("%08x %-21s %9ld %8ld %6.2f %9ld %10.3f\n", src->ssrc, from,
+	   src->received, lost(src), expected > 0 ? 100.0 * lost(src) / expected : 0.0,
+	   src->reordered, src->jitter * 1000 / src->clock);
+  }
+  free(order);
+}
+
+void receive(void)
+{
+  struct epoll_event evs[BATCH];
+  struct itimerspec its;
+  struct timeval tv;
+  int sfd, i, n;
+  size_t j;
+
+  NOERROR(rep = epoll_create1(0), "epoll_create1");
+  for (j = 0; j < tab.n; j++)
+    rjoin(&tab.sin[j]);
+
+  for (i = 0; i < BATCH; i++) {
+    riovs[i].iov_base = &rheads[i];
+    riovs[i].iov_len = sizeof(rheads[i]);
+    rmsgs[i].msg_hdr.msg_name = &rfrom[i];
+    rmsgs[i].msg_hdr.msg_namelen = sizeof(rfrom[i]);
+    rmsgs[i].msg_hdr.msg_iov = &riovs[i];
+    rmsgs[i].msg_hdr.msg_iovlen = 1;
+    rmsgs[i].msg_hdr.msg_control = rctl[i].buf;
+    rmsgs[i].msg_hdr.msg_controllen = sizeof(rctl[i].buf);
+  }
+
+  NOERROR(sfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK), "timerfd");
+  gettimeofday(&tv, 0);
+  bzero(&its, sizeof(its));
+  its.it_value.tv_sec = tv.tv_sec + 1;
+  its.it_interval.tv_sec = 1;
+  NOERROR(timerfd_settime(sfd, TFD_TIMER_ABSTIME, &its, 0), "timerfd_settime");
+  evs[0].events = EPOLLIN;
+  evs[0].data.fd = sfd;
+  NOERROR(epoll_ctl(rep, EPOLL_CTL_ADD, sfd, &evs[0]), "epoll_ctl");
+
+  signal(SIGINT, done);
+  signal(SIGTERM, done);
+  printf("Receiving %zu sessions on %zu sockets\n", tab.n, nrs);
+  printf("  pkts    kb/S   lost  reord   ssrc\n");
+  fflush(stdout);
+  while (!stop) {
+    n = epoll_wait(rep, evs, BATCH, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      if (evs[i].data.fd == sfd) {
+	uint64_t exp;
+
+	if (read(sfd, &exp, sizeof(exp)) > 0)
+	  rsecond();
+      } else
+	drain(evs[i].data.fd);
     }
   }
+  rsummary();
 }